@@ -1,6 +1,12 @@
 QT       += gui remoteobjects
 
 REPC_REPLICA = ../protocols/kernel.rep
+INCLUDEPATH += ../protocols
+
+HEADERS += \
+    ../protocols/drawcommands.h \
+    ../protocols/fastpath.h \
+    ../protocols/shm.h
 
 SOURCES += \
     main.cpp
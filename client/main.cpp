@@ -6,69 +6,94 @@
 #include <QCommandLineParser>
 #include <QCommandLineOption>
 #include <QDebug>
-#include <QSharedMemory>
 #include <QImage>
 #include <QPainter>
 
 #include "rep_kernel_replica.h"
+#include "shm.h"
+#include "fastpath.h"
+#include "drawcommands.h"
 
-#define PAINT_STATE "__paiting"
+#include <unistd.h>
 
-void paintButton(SurfaceReplica *surface)
+#define SHM_PAINT_PENDING "__shm_paint_pending"
+#define SHM_BUFFER "__shm_buffer"
+#define FRAME_PENDING "__frame_pending"
+#define REPAINT_PENDING "__repaint_pending"
+
+// 上一帧送显（frameDone）之前不再绘制新的一帧
+bool throttlePaint(SurfaceReplica *surface)
 {
-    if (surface->property(PAINT_STATE).toBool())
-        return;
+    if (!surface->property(FRAME_PENDING).toBool())
+        return false;
 
-    surface->setProperty(PAINT_STATE, true);
-    // paint
-    auto ok = surface->begin();
-    // TODO: use QRemoteObjectPendingCallWatcher
-    if (!ok.waitForFinished()) {
-        surface->setProperty(PAINT_STATE, false);
-        return;
-    }
-    if (!ok.returnValue()) {
-        surface->setProperty(PAINT_STATE, false);
+    surface->setProperty(REPAINT_PENDING, true);
+    return true;
+}
+
+void uploadButton(SurfaceReplica *surface)
+{
+    // 窗口尺寸改变时合成器会先自行回放，新的 display list 中只有背景不同，
+    // 合成器只重绘变化的部分
+    DrawCommands::Writer commands;
+    commands.fillRect(QRect(QPoint(0, 0), surface->geometry().size()), Qt::white);
+    commands.fillRect(QRect(102, 102, 50, 30), Qt::black);
+    commands.fillRect(QRect(100, 100, 50, 30), Qt::gray);
+    commands.drawText(QPoint(102, 102), "Button", Qt::red);
+    surface->setDisplayList(commands.data());
+}
+
+void drawToShm(SurfaceReplica *surface, uchar *shmPool, const ShmBuffer &shm)
+{
+    // 缓冲区仍被合成器持有时等到 bufferReleased 再绘制
+    auto header = Shm::bufferHeader(shmPool, shm.offset());
+    if (!Shm::isClientOwned(header)) {
+        surface->setProperty(SHM_PAINT_PENDING, true);
         return;
     }
 
-    surface->fillRect(QRect(QPoint(0, 0), surface->geometry().size()), Qt::white);
-    surface->fillRect(QRect(102, 102, 50, 30), Qt::black);
-    surface->fillRect(QRect(100, 100, 50, 30), Qt::gray);
-    surface->drawText(QPoint(102, 102), "Button", Qt::red);
-    surface->end();
-    surface->setProperty(PAINT_STATE, false);
+    QImage buffer(Shm::bufferData(shmPool, shm.offset()), shm.size().width(), shm.size().height(),
+                  shm.bytesPerLine(), QImage::Format_RGB888);
+    QPainter pa(&buffer);
+
+    pa.fillRect(QRect(QPoint(0, 0), shm.size()), Qt::white);
+    pa.drawImage(buffer.rect(), QImage("/home/zccrs/Downloads/Designer (3).png"));
+    pa.end();
+
+    Shm::commitBuffer(header);
+    surface->putImage(shm.id(), buffer.rect());
+    surface->setProperty(FRAME_PENDING, true);
 }
 
-void paintWithShm(SurfaceReplica *surface)
+void paintWithShm(SurfaceReplica *surface, uchar *shmPool)
 {
+    if (throttlePaint(surface))
+        return;
+
+    // 尺寸不变时复用已有的缓冲区
+    const auto current = surface->property(SHM_BUFFER).value<ShmBuffer>();
+    if (current.id() != 0 && current.size() == surface->geometry().size()) {
+        drawToShm(surface, shmPool, current);
+        return;
+    }
+
     auto watcher = new QRemoteObjectPendingCallWatcher(surface->getShm(), surface);
-    QObject::connect(watcher, &QRemoteObjectPendingCallWatcher::finished, surface, [watcher, surface] {
-        auto ret = watcher->returnValue().value<QPair<QString, QSize>>();
-        qDebug() << "Get shm:" << ret;
-
-        QSharedMemory shm(QNativeIpcKey(ret.first));
-        if (!shm.attach()) {
-            surface->releaseShm(ret.first);
-            qWarning() << "Can't attach to shm:" << shm.errorString();
-            return;
-        }
+    QObject::connect(watcher, &QRemoteObjectPendingCallWatcher::finished, surface, [watcher, surface, shmPool] {
+        auto ret = watcher->returnValue().value<ShmBuffer>();
+        watcher->deleteLater();
+        qDebug() << "Get shm:" << ret.id() << ret.offset() << ret.size();
 
-        if (!shm.lock()) {
-            qDebug() << "Can't lock shm.";
+        if (ret.offset() < 0) {
+            qWarning() << "Can't get shared buffer from compositor";
             return;
         }
 
-        QImage buffer(reinterpret_cast<uchar*>(shm.data()), ret.second.width(), ret.second.height(), QImage::Format_RGB888);
-        QPainter pa(&buffer);
-
-        pa.fillRect(QRect(QPoint(0, 0), ret.second), Qt::white);
-        pa.drawImage(buffer.rect(), QImage("/home/zccrs/Downloads/Designer (3).png"));
-        pa.end();
-
-        shm.unlock();
+        const auto old = surface->property(SHM_BUFFER).value<ShmBuffer>();
+        if (old.id() != 0)
+            surface->releaseShm(old.id());
+        surface->setProperty(SHM_BUFFER, QVariant::fromValue(ret));
 
-        surface->putImage(ret.first, buffer.rect());
+        drawToShm(surface, shmPool, ret);
     });
 }
 
@@ -89,16 +114,17 @@ int main(int argc, char **argv)
 
     std::unique_ptr<ManagerReplica> manager(node.acquire<ManagerReplica>());
     manager->waitForSource();
-    auto clientID = manager->createClient();
-    clientID.waitForFinished();
+    auto clientInfo = manager->createClient();
+    clientInfo.waitForFinished();
+    const QString clientID = clientInfo.returnValue().id();
 
     QObject::connect(&app, &QCoreApplication::aboutToQuit, manager.get(), [&] {
-        manager->destroyClient(clientID.returnValue());
+        manager->destroyClient(clientID);
     });
 
-    qDebug() << "New Client:" << clientID.returnValue();
+    qDebug() << "New Client:" << clientID;
 
-    std::unique_ptr<ClientReplica> client(node.acquire<ClientReplica>(clientID.returnValue()));
+    std::unique_ptr<ClientReplica> client(node.acquire<ClientReplica>(clientID));
     QObject::connect(client.get(), &ClientReplica::ping, client.get(), &ClientReplica::pong);
 
     client->waitForSource();
@@ -112,18 +138,55 @@ int main(int argc, char **argv)
     surface->waitForSource();
     surface->setVisible(true);
 
+    QObject::connect(surface.get(), &SurfaceReplica::presented,
+                     [] (quint32 serial, qint64 timestamp, qint64 refreshInterval, bool onTime) {
+        qDebug() << "Presented" << serial << "at" << timestamp << "refresh:" << refreshInterval
+                 << (onTime ? "on time" : "late");
+    });
+
     if (cmParser.isSet(useShm)) {
+        // 示例客户端只通过 fastpath 获取内存池，其余消息仍走 QtRO
+        int poolFd = -1;
+        qint64 shmPoolSize = 0;
+        int socket = FastPath::connectToCompositor(clientID, clientInfo.returnValue().token(),
+                                                   &poolFd, &shmPoolSize);
+        if (socket < 0)
+            qFatal("Can't connect to the compositor fastpath.");
+        ::close(socket);
+
+        uchar *shmPool = Shm::mapPool(poolFd, shmPoolSize);
+        ::close(poolFd);
+        if (!shmPool)
+            qFatal("Can't map the shm pool.");
+
         surface->setGeometry(QRect(100, 100, 600, 400));
-        QObject::connect(surface.get(), &SurfaceReplica::geometryChanged, [&] {
-            paintWithShm(surface.get());
+        QObject::connect(surface.get(), &SurfaceReplica::geometryChanged, [&, shmPool] {
+            paintWithShm(surface.get(), shmPool);
+        });
+        QObject::connect(surface.get(), &SurfaceReplica::bufferReleased, [&, shmPool] {
+            if (surface->property(SHM_PAINT_PENDING).toBool()) {
+                surface->setProperty(SHM_PAINT_PENDING, false);
+                paintWithShm(surface.get(), shmPool);
+            }
+        });
+        // 窗口隐藏期间合成器丢弃了内容
+        QObject::connect(surface.get(), &SurfaceReplica::repaintRequested, [&, shmPool] {
+            paintWithShm(surface.get(), shmPool);
+        });
+        QObject::connect(surface.get(), &SurfaceReplica::frameDone, [&, shmPool] {
+            surface->setProperty(FRAME_PENDING, false);
+            if (surface->property(REPAINT_PENDING).toBool()) {
+                surface->setProperty(REPAINT_PENDING, false);
+                paintWithShm(surface.get(), shmPool);
+            }
         });
-        paintWithShm(surface.get());
+        paintWithShm(surface.get(), shmPool);
     } else {
         surface->setGeometry(QRect(500, 500, 300, 200));
         QObject::connect(surface.get(), &SurfaceReplica::geometryChanged, [&] {
-            paintButton(surface.get());
+            uploadButton(surface.get());
         });
-        paintButton(surface.get());
+        uploadButton(surface.get());
     }
 
     return app.exec();
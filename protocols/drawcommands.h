@@ -0,0 +1,82 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QRect>
+#include <QColor>
+#include <QString>
+
+// Surface::submit 使用的绘制命令，客户端把一帧内的所有绘制序列化到一个
+// QByteArray 中一次发送，合成器按顺序执行，避免每个图元一次 IPC 往返
+namespace DrawCommands {
+
+enum Type : quint8 {
+    FillRect = 1,
+    DrawText = 2
+};
+
+class Writer
+{
+public:
+    Writer()
+        : m_stream(&m_data, QIODevice::WriteOnly) {}
+
+    void fillRect(const QRect &rect, const QColor &color) {
+        m_stream << quint8(FillRect) << rect << quint32(color.rgba());
+    }
+
+    void drawText(const QPoint &pos, const QString &text, const QColor &color) {
+        m_stream << quint8(DrawText) << pos << text << quint32(color.rgba());
+    }
+
+    const QByteArray &data() const {
+        return m_data;
+    }
+
+private:
+    QByteArray m_data;
+    QDataStream m_stream;
+};
+
+// 依次把 data 中的命令交给 handler 执行，遇到无法识别的数据时返回 false
+template<typename Handler>
+bool forEach(const QByteArray &data, Handler &handler)
+{
+    QDataStream stream(data);
+
+    while (!stream.atEnd()) {
+        quint8 type = 0;
+        stream >> type;
+
+        switch (type) {
+        case FillRect: {
+            QRect rect;
+            quint32 color;
+            stream >> rect >> color;
+            if (stream.status() != QDataStream::Ok)
+                return false;
+            handler.fillRect(rect, QColor::fromRgba(color));
+            break;
+        }
+        case DrawText: {
+            QPoint pos;
+            QString text;
+            quint32 color;
+            stream >> pos >> text >> color;
+            if (stream.status() != QDataStream::Ok)
+                return false;
+            handler.drawText(pos, text, QColor::fromRgba(color));
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+
+    return stream.status() == QDataStream::Ok;
+}
+
+} // namespace DrawCommands
@@ -0,0 +1,287 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QDir>
+#include <QFile>
+
+#include <cstddef>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// 热路径上的消息（输入事件、提交、缓冲区归还、帧回调）不经过 QtRO，而是以
+// 定长的二进制消息在 SOCK_SEQPACKET 类型的 unix socket 上传递。对象的创建和
+// 属性仍然使用 QtRO，未建立该连接的客户端会退回到 QtRO 的信号和槽
+namespace FastPath {
+
+enum Opcode : quint16 {
+    // 客户端 -> 合成器
+    Hello = 1,
+    Commit,
+
+    // 合成器 -> 客户端
+    Pool,
+    CommitFailed,
+    BufferReleased,
+    FrameDone,
+    Presented,
+    MouseEvent,
+    WheelEvent,
+    KeyEvent,
+
+    // 客户端请求通过共享内存接收输入事件，合成器回复 InputRing 并附带 eventfd
+    EnableInputRing,
+    InputRing,
+
+    // 合成器 -> 客户端，长文本的按键事件中除最后一段以外的文本，格式同 KeyMessage
+    KeyText
+};
+
+struct Header
+{
+    quint16 opcode;
+    quint16 size;
+    // 目标 Surface 的 handle，与 Surface 无关的消息为 0
+    quint32 surface;
+};
+
+// 用于 FrameDone 等不携带数据的消息
+struct Message
+{
+    Header header;
+};
+
+struct Rect
+{
+    qint32 x, y, width, height;
+};
+
+// 握手：客户端发送自己的 id 及 createClient 返回的 token，合成器回复 Pool 并
+// 附带内存池的文件描述符。每个客户端只能握手一次
+static constexpr int TokenSize = 16;
+
+struct HelloMessage
+{
+    Header header;
+    char clientId[64];
+    char token[TokenSize];
+};
+
+struct PoolMessage
+{
+    Header header;
+    qint64 capacity;
+};
+
+// InputRing 在共享内存池中的位置，布局见 inputring.h
+struct InputRingMessage
+{
+    Header header;
+    qint64 offset;
+};
+
+struct CommitMessage
+{
+    enum Flag : quint32 {
+        // 使用 putImage 的拷贝语义，缓冲区在处理完后立即归还
+        Copy = 0x1
+    };
+
+    // 超出时合并为外接矩形
+    static constexpr int MaxRects = 128;
+
+    Header header;
+    quint32 buffer;
+    quint32 flags;
+    quint32 rectCount;
+    Rect rects[MaxRects];
+};
+
+// 用于 CommitFailed 和 BufferReleased
+struct BufferMessage
+{
+    Header header;
+    quint32 buffer;
+};
+
+struct PresentedMessage
+{
+    Header header;
+    quint32 serial;
+    quint32 onTime;
+    qint64 timestamp;
+    qint64 refreshInterval;
+};
+
+struct MouseMessage
+{
+    Header header;
+    quint32 type;
+    qint32 localX, localY;
+    qint32 globalX, globalY;
+    quint32 button;
+    quint32 buttons;
+    quint32 modifiers;
+};
+
+struct WheelMessage
+{
+    Header header;
+    qint32 localX, localY;
+    qint32 globalX, globalY;
+    qint32 angleDeltaX, angleDeltaY;
+    quint32 buttons;
+    quint32 modifiers;
+};
+
+struct KeyMessage
+{
+    // 更长的文本（如输入法一次提交的句子）拆成多段，前面的段以 KeyText 发送
+    static constexpr int MaxTextLength = 16;
+
+    Header header;
+    quint32 type;
+    qint32 key;
+    quint32 modifiers;
+    quint32 textLength;
+    char16_t text[MaxTextLength];
+};
+
+static constexpr size_t MaxMessageSize = sizeof(CommitMessage);
+
+template<typename T>
+inline T message(Opcode opcode, quint32 surface = 0)
+{
+    T msg;
+    memset(&msg, 0, sizeof(T));
+    msg.header.opcode = opcode;
+    msg.header.size = sizeof(T);
+    msg.header.surface = surface;
+    return msg;
+}
+
+// 变长消息实际需要发送的字节数
+inline size_t commitSize(const CommitMessage &msg)
+{
+    return offsetof(CommitMessage, rects) + msg.rectCount * sizeof(Rect);
+}
+
+inline QByteArray socketPath()
+{
+    return QFile::encodeName(QDir::tempPath() + QStringLiteral("/X.STONE.fastpath"));
+}
+
+inline bool fillAddress(sockaddr_un *addr)
+{
+    const QByteArray path = socketPath();
+    if (path.size() >= int(sizeof(addr->sun_path)))
+        return false;
+
+    memset(addr, 0, sizeof(sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path.constData(), path.size());
+    return true;
+}
+
+inline bool sendFd(int socket, int fd, const void *data, size_t size)
+{
+    iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = size;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return ::sendmsg(socket, &msg, MSG_NOSIGNAL) == ssize_t(size);
+}
+
+// 返回接收到的数据长度，未携带文件描述符时 *fd 为 -1
+inline ssize_t receiveFd(int socket, int *fd, void *data, size_t size, int flags = 0)
+{
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    const ssize_t n = ::recvmsg(socket, &msg, flags | MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return n;
+
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return n;
+}
+
+// 客户端使用：连接合成器并完成握手，成功时返回 socket，*poolFd 为共享内存池
+inline int connectToCompositor(const QString &clientId, const QByteArray &token,
+                               int *poolFd, qint64 *poolSize)
+{
+    *poolFd = -1;
+
+    sockaddr_un addr;
+    if (!fillAddress(&addr))
+        return -1;
+
+    int socket = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (socket < 0)
+        return -1;
+
+    auto hello = message<HelloMessage>(Hello);
+    const QByteArray id = clientId.toUtf8();
+    if (id.size() >= int(sizeof(hello.clientId)) || token.size() != TokenSize) {
+        ::close(socket);
+        return -1;
+    }
+    memcpy(hello.clientId, id.constData(), id.size());
+    memcpy(hello.token, token.constData(), TokenSize);
+
+    PoolMessage pool;
+    if (::connect(socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0
+        && ::send(socket, &hello, sizeof(hello), MSG_NOSIGNAL) == sizeof(hello)
+        && receiveFd(socket, poolFd, &pool, sizeof(pool)) == sizeof(pool)
+        && pool.header.opcode == Pool && *poolFd >= 0) {
+        *poolSize = pool.capacity;
+        return socket;
+    }
+
+    if (*poolFd >= 0) {
+        ::close(*poolFd);
+        *poolFd = -1;
+    }
+    ::close(socket);
+
+    return -1;
+}
+
+} // namespace FastPath
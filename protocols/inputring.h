@@ -0,0 +1,105 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QtGlobal>
+
+#include <atomic>
+
+// 合成器发给客户端的输入事件环形缓冲区，位于客户端的共享内存池中。合成器
+// 只写入定长的记录，在缓冲区由空变为非空时通过 eventfd 唤醒客户端；客户端
+// 读完后推进 head。缓冲区满时合成器暂存新的事件，其中连续的移动事件只保留
+// 最新的一个，被合并掉的数量计入 dropped
+namespace InputRing {
+
+static constexpr quint32 Capacity = 256;
+static_assert((Capacity & (Capacity - 1)) == 0);
+
+struct Record
+{
+    enum Kind : quint16 {
+        Mouse = 1,
+        Wheel,
+        Key,
+        // 超过 MaxTextLength 的文本拆成多段，前面的段以 KeyText 记录依次发出，
+        // 紧随其后的 Key 记录携带最后一段
+        KeyText
+    };
+
+    static constexpr int MaxTextLength = 16;
+
+    quint32 surface;
+    quint16 kind;
+    quint16 type;
+    qint32 localX, localY;
+    qint32 globalX, globalY;
+    quint32 button;
+    quint32 buttons;
+    quint32 modifiers;
+    // 键盘事件为 Qt::Key，滚轮事件为 angleDelta
+    qint32 key;
+    qint32 angleDeltaX, angleDeltaY;
+    quint32 textLength;
+    char16_t text[MaxTextLength];
+};
+
+struct Header
+{
+    // 客户端下一次读取的位置
+    alignas(64) std::atomic<quint32> head;
+    // 合成器下一次写入的位置
+    alignas(64) std::atomic<quint32> tail;
+    // 因缓冲区已满而被合并掉的移动事件数
+    alignas(64) std::atomic<quint32> dropped;
+};
+
+static_assert(std::atomic<quint32>::is_always_lock_free);
+
+// 记录紧跟在头部之后
+static constexpr qint64 Size = sizeof(Header) + Capacity * sizeof(Record);
+
+inline Record *records(Header *ring)
+{
+    return reinterpret_cast<Record*>(reinterpret_cast<uchar*>(ring) + sizeof(Header));
+}
+
+// 合成器使用：返回 false 表示缓冲区已满。*wake 为 true 时需要唤醒客户端。
+// tail 的写入与随后 head 的读取都使用 seq_cst，与客户端的 consume 配对，
+// 保证客户端不会在还有未读事件时睡眠
+inline bool push(Header *ring, const Record &record, bool *wake)
+{
+    const quint32 tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) == Capacity) {
+        *wake = false;
+        return false;
+    }
+
+    records(ring)[tail & (Capacity - 1)] = record;
+    ring->tail.store(tail + 1, std::memory_order_seq_cst);
+    *wake = ring->head.load(std::memory_order_seq_cst) == tail;
+    return true;
+}
+
+// 客户端使用：依次把未读的记录交给 handler，返回处理的数量
+template<typename Handler>
+inline int consume(Header *ring, Handler handler)
+{
+    int count = 0;
+    quint32 head = ring->head.load(std::memory_order_relaxed);
+
+    while (true) {
+        const quint32 tail = ring->tail.load(std::memory_order_seq_cst);
+        if (head == tail)
+            break;
+
+        for (; head != tail; ++head, ++count)
+            handler(records(ring)[head & (Capacity - 1)]);
+
+        ring->head.store(head, std::memory_order_seq_cst);
+    }
+
+    return count;
+}
+
+} // namespace InputRing
@@ -0,0 +1,74 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QtGlobal>
+
+#include <atomic>
+#include <sys/mman.h>
+
+// 合成器为每个客户端创建一个基于 memfd 的共享内存池，通过 fastpath 连接以
+// SCM_RIGHTS 的方式只传递一次，之后所有的缓冲区都以偏移量的形式在池中分配
+namespace Shm {
+
+// 每个缓冲区起始处的头部，像素数据紧随其后。缓冲区的所有权通过 owner 原子地
+// 在客户端与合成器之间移交，任何一方都不会持有锁，合成器也从不等待客户端
+struct BufferHeader
+{
+    enum Owner : quint32 {
+        // 客户端可以写入，合成器不会读取
+        ClientOwned = 0,
+        // 客户端已提交，合成器读取完毕后通过 bufferReleased 归还
+        CompositorOwned = 1
+    };
+
+    std::atomic<quint32> owner;
+};
+
+static_assert(std::atomic<quint32>::is_always_lock_free);
+
+// 保持像素数据按缓存行对齐
+static constexpr qint64 HeaderSize = 64;
+static_assert(sizeof(BufferHeader) <= HeaderSize);
+
+inline BufferHeader *bufferHeader(uchar *pool, qint64 offset)
+{
+    return reinterpret_cast<BufferHeader*>(pool + offset);
+}
+
+inline uchar *bufferData(uchar *pool, qint64 offset)
+{
+    return pool + offset + HeaderSize;
+}
+
+// 客户端使用
+inline bool isClientOwned(const BufferHeader *header)
+{
+    return header->owner.load(std::memory_order_acquire) == BufferHeader::ClientOwned;
+}
+
+inline void commitBuffer(BufferHeader *header)
+{
+    header->owner.store(BufferHeader::CompositorOwned, std::memory_order_release);
+}
+
+// 合成器使用
+inline bool isCompositorOwned(const BufferHeader *header)
+{
+    return header->owner.load(std::memory_order_acquire) == BufferHeader::CompositorOwned;
+}
+
+inline void releaseBuffer(BufferHeader *header)
+{
+    header->owner.store(BufferHeader::ClientOwned, std::memory_order_release);
+}
+
+// 客户端使用：映射合成器传递过来的内存池
+inline uchar *mapPool(int fd, qint64 size)
+{
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return ptr == MAP_FAILED ? nullptr : static_cast<uchar*>(ptr);
+}
+
+} // namespace Shm
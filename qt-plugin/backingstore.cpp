@@ -3,21 +3,46 @@
 
 #include "backingstore.h"
 #include "platformwindow.h"
+#include "connection.h"
+#include "shm.h"
 
-#include <QSharedMemory>
 #include <QGuiApplication>
 #include <QTimer>
 
+#include <utility>
+
 #include <qpa/qwindowsysteminterface.h>
 
-BackingStore::BackingStore(QWindow *window)
+// 双缓冲，合成器读取其中一个缓冲区时客户端可以在另一个上绘制，必要时会再增加一个。
+// 合成器不允许一个窗口持有更多的缓冲区
+static constexpr int BufferCount = 2;
+static constexpr int MaxBufferCount = 3;
+
+static void copyImage(const QImage &from, QImage &to, const QRegion &region)
+{
+    const int bpp = to.depth() / 8;
+    for (const QRect &r : region & from.rect() & to.rect()) {
+        for (int y = r.top(); y <= r.bottom(); ++y) {
+            memcpy(to.scanLine(y) + r.left() * bpp,
+                   from.constScanLine(y) + r.left() * bpp,
+                   r.width() * bpp);
+        }
+    }
+}
+
+BackingStore::BackingStore(QWindow *window, Connection *connection)
     : QPlatformBackingStore(window)
+    , m_connection(connection)
+    , m_shmPool(connection->shmPool())
 {
     QTimer::singleShot(0, [this] {
         if (auto pw = platformWindow()) {
             pw->setSurfaceWatcher([this] {
                 updateBuffer();
             });
+            pw->setBufferWatcher([this] (quint32 id, bool rejected) {
+                onBufferReleased(id, rejected);
+            });
 
             updateBuffer();
         }
@@ -26,12 +51,14 @@ BackingStore::BackingStore(QWindow *window)
 
 QPaintDevice *BackingStore::paintDevice()
 {
-    return &m_image;
+    return m_current >= 0 ? &m_buffers[m_current].image : &m_shadow;
 }
 
 QImage BackingStore::toImage() const
 {
-    return m_image;
+    if (m_current >= 0)
+        return m_buffers.at(m_current).image;
+    return m_paintingShadow ? m_shadow : QImage();
 }
 
 void BackingStore::resize(const QSize &size, const QRegion &staticContents)
@@ -39,23 +66,108 @@ void BackingStore::resize(const QSize &size, const QRegion &staticContents)
     updateBuffer();
 }
 
-void BackingStore::flush(QWindow *window, const QRegion &region, const QPoint &offset)
+void BackingStore::flush(QWindow *window, const QRegion &flushRegion, const QPoint &offset)
 {
-    if (auto s = this->surface())
-        s->putImage(m_shm->nativeKey(), region);
+    if (m_current < 0) {
+        // 影子图像上的内容等缓冲区归还后再提交
+        if (m_paintingShadow)
+            m_deferredRegion += flushRegion.isEmpty() ? QRegion(m_shadow.rect()) : flushRegion;
+        return;
+    }
+
+    auto s = this->surface();
+    if (!s)
+        return;
+
+    // 影子图像上积压的内容已在 prepareBuffer 中复制到这个缓冲区，一起提交
+    QRegion region = flushRegion;
+    if (!region.isEmpty())
+        region += m_deferredRegion;
+    m_deferredRegion = QRegion();
+
+    auto &buffer = m_buffers[m_current];
+    auto header = Shm::bufferHeader(m_shmPool, buffer.shm.offset());
+    Shm::commitBuffer(header);
+
+    // 合成器会直接从该缓冲区合成，直到下一次提交后才归还。优先经由 fastpath
+    // 提交，被拒绝时会收到 CommitFailed
+    if (!m_connection->commit(s->handle(), buffer.shm.id(), region)) {
+        auto watcher = new QRemoteObjectPendingCallWatcher(s->commit(buffer.shm.id(), region), s);
+        QObject::connect(watcher, &QRemoteObjectPendingCallWatcher::finished, s, [this, watcher, header] {
+            // 合成器拒绝了这次提交，缓冲区的所有权仍然属于客户端，也不会有 frameDone
+            if (!watcher->returnValue().toBool()) {
+                Shm::releaseBuffer(header);
+                if (auto pw = platformWindow())
+                    pw->onFrameDone();
+                flushDeferred();
+            }
+            watcher->deleteLater();
+        });
+    }
+    platformWindow()->m_waitingForFrame = true;
+
+    const QRegion damage = region.isEmpty() ? QRegion(buffer.image.rect()) : region;
+    for (int i = 0; i < m_buffers.size(); ++i) {
+        if (i != m_current)
+            m_buffers[i].stale += damage;
+    }
+    buffer.stale = QRegion();
+    m_front = m_current;
 }
 
-void BackingStore::beginPaint(const QRegion &)
+void BackingStore::beginPaint(const QRegion &region)
 {
-    if (!m_shm->lock()) {
-        qDebug() << "Can't lock shm.";
+    m_current = -1;
+    m_paintingShadow = false;
+    if (m_buffers.isEmpty()) {
+        // 等待尺寸变化后新的缓冲区
+        if (m_generation > 0 && !m_needsExpose)
+            beginShadowPaint(region);
         return;
     }
+
+    const int index = findFreeBuffer();
+    if (index < 0) {
+        // 所有缓冲区都被合成器持有，不能写入。先绘制到影子图像上，同时申请
+        // 一个新的缓冲区供后续帧使用
+        beginShadowPaint(region);
+        if (m_buffers.size() < MaxBufferCount && !m_requestingExtraBuffer) {
+            m_requestingExtraBuffer = true;
+            requestBuffer(m_generation);
+        }
+        return;
+    }
+
+    m_current = index;
+    prepareBuffer(index, region);
 }
 
-void BackingStore::endPaint()
+void BackingStore::prepareBuffer(int index, const QRegion &region)
 {
-    m_shm->unlock();
+    auto &buffer = m_buffers[index];
+
+    // 影子图像上还未提交的内容比任何缓冲区都新，其余本次不会重绘的过期内容
+    // 从最近提交的缓冲区补齐
+    copyImage(m_shadow, buffer.image, m_deferredRegion - region);
+    if (m_front >= 0 && m_front != index)
+        copyImage(m_buffers.at(m_front).image, buffer.image, buffer.stale - region - m_deferredRegion);
+    buffer.stale = QRegion();
+}
+
+void BackingStore::beginShadowPaint(const QRegion &region)
+{
+    const QImage *front = m_buffers.isEmpty() ? nullptr : &m_buffers.at(m_front >= 0 ? m_front : 0).image;
+    const QSize size = front ? front->size() : window()->size();
+    if (m_shadow.size() != size) {
+        m_shadow = QImage(size, QImage::Format_RGB888);
+        m_shadow.fill(Qt::white);
+        m_deferredRegion = QRegion();
+    }
+
+    // 部件可能只绘制其中的一部分（如半透明的部件），需要先有最新的内容
+    if (front)
+        copyImage(*front, m_shadow, region - m_deferredRegion);
+    m_paintingShadow = true;
 }
 
 PlatformWindow *BackingStore::platformWindow() const
@@ -73,27 +185,82 @@ SurfaceReplica *BackingStore::surface() const
 void BackingStore::updateBuffer()
 {
     auto surface = this->surface();
-    if (!surface)
+    if (!surface || !m_shmPool)
         return;
 
+    // 尺寸变化后旧的回复都作废
+    ++m_generation;
+    m_requestingExtraBuffer = false;
+    releaseBuffers(m_pendingBuffers);
+
+    // 合成器限制了每个窗口的缓冲区数，旧的缓冲区先归还，已提交的内容由合成器
+    // 保留。新的缓冲区就绪之前绘制到影子图像上
+    releaseBuffers(m_buffers);
+    m_current = -1;
+    m_front = -1;
+
+    // 隐藏期间不占用共享内存，显示时重新申请，新的缓冲区就绪后会完整重绘
+    if (!surface->visible()) {
+        m_needsExpose = true;
+        m_shadow = QImage();
+        m_paintingShadow = false;
+        m_deferredRegion = QRegion();
+        return;
+    }
+
+    for (int i = 0; i < BufferCount; ++i)
+        requestBuffer(m_generation);
+}
+
+void BackingStore::requestBuffer(int generation)
+{
+    auto surface = this->surface();
     auto watcher = new QRemoteObjectPendingCallWatcher(surface->getShm(), surface);
-    QObject::connect(watcher, &QRemoteObjectPendingCallWatcher::finished, surface, [this, watcher, surface] {
-        auto ret = watcher->returnValue().value<QPair<QString, QSize>>();
+    QObject::connect(watcher, &QRemoteObjectPendingCallWatcher::finished, surface, [this, watcher, surface, generation] {
+        auto ret = watcher->returnValue().value<ShmBuffer>();
         watcher->deleteLater();
-        qDebug() << "Get shm:" << ret;
+        qDebug() << "Get shm:" << ret.id() << ret.offset() << ret.size();
+
+        if (ret.offset() < 0) {
+            qWarning() << "Can't get shared buffer from compositor";
+            return;
+        }
+
+        if (generation != m_generation) {
+            surface->releaseShm(ret.id());
+            return;
+        }
+
+        Buffer buffer;
+        buffer.shm = ret;
+        buffer.image = QImage(Shm::bufferData(m_shmPool, ret.offset()), ret.size().width(), ret.size().height(),
+                              ret.bytesPerLine(), QImage::Format_RGB888);
 
-        std::unique_ptr<QSharedMemory> shm(new QSharedMemory(QNativeIpcKey(ret.first)));
-        if (!shm->attach()) {
-            surface->releaseShm(ret.first);
-            qWarning() << "Can't attach to shm:" << shm->errorString();
+        if (m_requestingExtraBuffer && m_pendingBuffers.isEmpty()
+            && !m_buffers.isEmpty() && m_buffers.first().shm.size() == ret.size()) {
+            m_requestingExtraBuffer = false;
+            buffer.stale = buffer.image.rect();
+            m_buffers.append(buffer);
+            flushDeferred();
             return;
         }
 
-        bool oldShmIsNull = !m_shm;
-        m_image = QImage(reinterpret_cast<uchar*>(shm->data()), ret.second.width(), ret.second.height(), QImage::Format_RGB888);
-        m_shm.reset(shm.release());
+        m_pendingBuffers.append(buffer);
+        if (m_pendingBuffers.size() < BufferCount)
+            return;
 
-        if (oldShmIsNull) {
+        m_buffers.swap(m_pendingBuffers);
+        m_current = 0;
+        m_front = -1;
+        // 影子图像中的内容只有尺寸不变时还有效
+        if (m_shadow.size() == m_buffers.first().image.size()) {
+            flushDeferred();
+        } else {
+            m_shadow = QImage();
+            m_deferredRegion = QRegion();
+        }
+
+        if (std::exchange(m_needsExpose, false)) {
             const QPoint cursorPos = QCursor::pos();
             if (window()->isVisible()) {
                 QRect rect(QPoint(), platformWindow()->geometry().size());
@@ -115,3 +282,61 @@ void BackingStore::updateBuffer()
         }
     });
 }
+
+void BackingStore::onBufferReleased(quint32 id, bool rejected)
+{
+    // 被拒绝的提交不会再由合成器归还，所有权需要自己收回
+    if (rejected) {
+        for (const auto &buffer : std::as_const(m_buffers)) {
+            if (buffer.shm.id() == id) {
+                Shm::releaseBuffer(Shm::bufferHeader(m_shmPool, buffer.shm.offset()));
+                break;
+            }
+        }
+    }
+
+    flushDeferred();
+}
+
+void BackingStore::flushDeferred()
+{
+    if (m_deferredRegion.isEmpty())
+        return;
+
+    const int index = findFreeBuffer();
+    if (index < 0)
+        return;
+
+    // 不重绘，直接提交影子图像上的内容
+    m_current = index;
+    m_paintingShadow = false;
+    prepareBuffer(index, QRegion());
+    flush(window(), m_deferredRegion, QPoint());
+}
+
+void BackingStore::releaseBuffers(QList<Buffer> &buffers)
+{
+    if (auto surface = this->surface()) {
+        for (const auto &buffer : std::as_const(buffers))
+            surface->releaseShm(buffer.shm.id());
+    }
+
+    buffers.clear();
+}
+
+int BackingStore::findFreeBuffer() const
+{
+    int index = -1;
+
+    for (int i = 0; i < m_buffers.size(); ++i) {
+        if (!Shm::isClientOwned(Shm::bufferHeader(m_shmPool, m_buffers.at(i).shm.offset())))
+            continue;
+
+        // 优先使用不是最近提交的缓冲区，合成器可能仍需要读取它
+        if (i != m_front)
+            return i;
+        index = i;
+    }
+
+    return index;
+}
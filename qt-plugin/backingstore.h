@@ -5,13 +5,13 @@
 
 #include "rep_kernel_replica.h"
 #include <qpa/qplatformbackingstore.h>
-#include <QSharedMemory>
 
 class PlatformWindow;
+class Connection;
 class BackingStore : public QPlatformBackingStore
 {
 public:
-    explicit BackingStore(QWindow *window);
+    explicit BackingStore(QWindow *window, Connection *connection);
 
     QPaintDevice *paintDevice() override;
     QImage toImage() const override;
@@ -20,14 +20,42 @@ public:
     void flush(QWindow *window, const QRegion &region, const QPoint &offset) override;
 
     void beginPaint(const QRegion&) override;
-    void endPaint() override;
 
     PlatformWindow *platformWindow() const;
     SurfaceReplica *surface() const;
 
 private:
-    void updateBuffer();
+    struct Buffer {
+        ShmBuffer shm;
+        QImage image;
+        // 其它缓冲区提交过、而本缓冲区还未更新的区域
+        QRegion stale;
+    };
 
-    std::unique_ptr<QSharedMemory> m_shm;
-    QImage m_image;
+    void updateBuffer();
+    void requestBuffer(int generation);
+    void onBufferReleased(quint32 id, bool rejected);
+    void prepareBuffer(int index, const QRegion &region);
+    void beginShadowPaint(const QRegion &region);
+    void flushDeferred();
+    void releaseBuffers(QList<Buffer> &buffers);
+    int findFreeBuffer() const;
+
+    Connection *m_connection;
+    uchar *m_shmPool;
+    QList<Buffer> m_buffers;
+    // 所有缓冲区都被合成器持有时的绘制目标
+    QImage m_shadow;
+    bool m_paintingShadow = false;
+    QList<Buffer> m_pendingBuffers;
+    int m_generation = 0;
+    // 第一次显示或重新显示时，缓冲区就绪后发出 expose
+    bool m_needsExpose = true;
+    // 正在绘制的缓冲区
+    int m_current = -1;
+    // 最近一次提交给合成器的缓冲区
+    int m_front = -1;
+    bool m_requestingExtraBuffer = false;
+    // 绘制在影子图像上、还未提交的区域，缓冲区归还后复制过去提交
+    QRegion m_deferredRegion;
 };
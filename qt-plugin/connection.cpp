@@ -0,0 +1,276 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#include "connection.h"
+#include "platformwindow.h"
+#include "shm.h"
+
+#include <QSocketNotifier>
+#include <QDebug>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+Connection::Connection() {}
+
+Connection::~Connection()
+{
+    disconnect();
+
+    m_inputNotifier.reset();
+    if (m_inputRingFd >= 0)
+        ::close(m_inputRingFd);
+
+    if (m_shmPool)
+        munmap(m_shmPool, m_shmPoolSize);
+}
+
+bool Connection::connectToCompositor(const QString &clientId, const QByteArray &token)
+{
+    int poolFd = -1;
+    m_socket = FastPath::connectToCompositor(clientId, token, &poolFd, &m_shmPoolSize);
+    if (m_socket < 0)
+        return false;
+
+    m_shmPool = Shm::mapPool(poolFd, m_shmPoolSize);
+    ::close(poolFd);
+    if (!m_shmPool) {
+        disconnect();
+        return false;
+    }
+
+    m_notifier.reset(new QSocketNotifier(m_socket, QSocketNotifier::Read));
+    QObject::connect(m_notifier.get(), &QSocketNotifier::activated, [this] {
+        onReadyRead();
+    });
+
+    // 输入事件改为经由共享内存接收
+    auto enable = FastPath::message<FastPath::Message>(FastPath::EnableInputRing);
+    if (::send(m_socket, &enable, sizeof(enable), MSG_NOSIGNAL) != sizeof(enable))
+        qWarning() << "Can't enable the input ring:" << strerror(errno);
+
+    return true;
+}
+
+bool Connection::isConnected() const
+{
+    return m_socket >= 0;
+}
+
+uchar *Connection::shmPool() const
+{
+    return m_shmPool;
+}
+
+void Connection::addWindow(quint32 surface, PlatformWindow *window)
+{
+    m_windows.insert(surface, window);
+}
+
+void Connection::removeWindow(quint32 surface)
+{
+    m_windows.remove(surface);
+}
+
+bool Connection::commit(quint32 surface, quint32 buffer, const QRegion &region)
+{
+    if (m_socket < 0)
+        return false;
+
+    auto msg = FastPath::message<FastPath::CommitMessage>(FastPath::Commit, surface);
+    msg.buffer = buffer;
+
+    auto append = [&msg] (const QRect &rect) {
+        auto &r = msg.rects[msg.rectCount++];
+        r.x = rect.x();
+        r.y = rect.y();
+        r.width = rect.width();
+        r.height = rect.height();
+    };
+
+    if (region.rectCount() > FastPath::CommitMessage::MaxRects) {
+        append(region.boundingRect());
+    } else {
+        for (const QRect &rect : region)
+            append(rect);
+    }
+
+    msg.header.size = FastPath::commitSize(msg);
+    // 提交是客户端唯一的热路径消息，socket 缓冲区满时宁可等待也不能丢弃
+    if (::send(m_socket, &msg, msg.header.size, MSG_NOSIGNAL) != msg.header.size) {
+        qWarning() << "Can't send commit to compositor:" << strerror(errno);
+        disconnect();
+        return false;
+    }
+
+    return true;
+}
+
+void Connection::onReadyRead()
+{
+    alignas(8) char buffer[FastPath::MaxMessageSize];
+
+    while (m_socket >= 0) {
+        int fd = -1;
+        const ssize_t size = FastPath::receiveFd(m_socket, &fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size == 0) {
+            qWarning() << "The compositor closed the fastpath connection";
+            disconnect();
+            return;
+        }
+
+        if (size < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                disconnect();
+            return;
+        }
+
+        auto header = reinterpret_cast<const FastPath::Header*>(buffer);
+        if (size_t(size) < sizeof(FastPath::Header) || header->size != size) {
+            if (fd >= 0)
+                ::close(fd);
+            continue;
+        }
+
+        dispatch(header, fd);
+    }
+}
+
+void Connection::dispatch(const FastPath::Header *message, int fd)
+{
+    if (message->opcode == FastPath::InputRing) {
+        auto msg = reinterpret_cast<const FastPath::InputRingMessage*>(message);
+        setupInputRing(msg->offset, fd);
+        return;
+    }
+
+    // 只有 InputRing 会附带文件描述符
+    if (fd >= 0)
+        ::close(fd);
+
+    auto window = m_windows.value(message->surface);
+    if (!window)
+        return;
+
+    switch (message->opcode) {
+    case FastPath::MouseEvent: {
+        auto msg = reinterpret_cast<const FastPath::MouseMessage*>(message);
+        window->handleMouseEvent(QEvent::Type(msg->type), QPoint(msg->localX, msg->localY),
+                                 QPoint(msg->globalX, msg->globalY), Qt::MouseButton(msg->button),
+                                 Qt::MouseButtons(msg->buttons), Qt::KeyboardModifiers(msg->modifiers));
+        break;
+    }
+    case FastPath::WheelEvent: {
+        auto msg = reinterpret_cast<const FastPath::WheelMessage*>(message);
+        window->handleWheelEvent(QPoint(msg->localX, msg->localY), QPoint(msg->globalX, msg->globalY),
+                                 QPoint(msg->angleDeltaX, msg->angleDeltaY),
+                                 Qt::MouseButtons(msg->buttons), Qt::KeyboardModifiers(msg->modifiers));
+        break;
+    }
+    case FastPath::KeyText: {
+        auto msg = reinterpret_cast<const FastPath::KeyMessage*>(message);
+        const int length = qMin<int>(msg->textLength, FastPath::KeyMessage::MaxTextLength);
+        m_keyText += QStringView(msg->text, length);
+        break;
+    }
+    case FastPath::KeyEvent: {
+        auto msg = reinterpret_cast<const FastPath::KeyMessage*>(message);
+        const int length = qMin<int>(msg->textLength, FastPath::KeyMessage::MaxTextLength);
+        window->handleKeyEvent(QEvent::Type(msg->type), msg->key, Qt::KeyboardModifiers(msg->modifiers),
+                               std::exchange(m_keyText, QString()) + QStringView(msg->text, length));
+        break;
+    }
+    case FastPath::FrameDone:
+        window->onFrameDone();
+        break;
+    case FastPath::CommitFailed:
+        // 被拒绝的提交不会有 frameDone，缓冲区的所有权也仍属于客户端
+        window->onFrameDone();
+        window->onBufferReleased(reinterpret_cast<const FastPath::BufferMessage*>(message)->buffer, true);
+        break;
+    case FastPath::BufferReleased:
+        window->onBufferReleased(reinterpret_cast<const FastPath::BufferMessage*>(message)->buffer, false);
+        break;
+    case FastPath::Presented:
+        break;
+    default:
+        qWarning() << "Unknown fastpath message:" << message->opcode;
+        break;
+    }
+}
+
+void Connection::disconnect()
+{
+    m_notifier.reset();
+
+    if (m_socket >= 0) {
+        ::close(m_socket);
+        m_socket = -1;
+    }
+}
+
+void Connection::setupInputRing(qint64 offset, int fd)
+{
+    if (fd < 0 || m_inputRing || offset < 0 || offset + InputRing::Size > m_shmPoolSize) {
+        if (fd >= 0)
+            ::close(fd);
+        return;
+    }
+
+    m_inputRing = reinterpret_cast<InputRing::Header*>(m_shmPool + offset);
+    m_inputRingFd = fd;
+    m_inputNotifier.reset(new QSocketNotifier(fd, QSocketNotifier::Read));
+    QObject::connect(m_inputNotifier.get(), &QSocketNotifier::activated, [this] {
+        onInputReady();
+    });
+
+    // 合成器可能在建立之前已经写入了事件
+    onInputReady();
+}
+
+void Connection::onInputReady()
+{
+    quint64 value;
+    while (::read(m_inputRingFd, &value, sizeof(value)) > 0);
+
+    const quint32 dropped = m_inputRing->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+        qDebug() << "The compositor coalesced" << dropped << "pointer motion events";
+
+    // 一次唤醒处理所有积压的事件
+    InputRing::consume(m_inputRing, [this] (const InputRing::Record &record) {
+        auto window = m_windows.value(record.surface);
+        if (!window)
+            return;
+
+        switch (record.kind) {
+        case InputRing::Record::Mouse:
+            window->handleMouseEvent(QEvent::Type(record.type), QPoint(record.localX, record.localY),
+                                     QPoint(record.globalX, record.globalY), Qt::MouseButton(record.button),
+                                     Qt::MouseButtons(record.buttons), Qt::KeyboardModifiers(record.modifiers));
+            break;
+        case InputRing::Record::Wheel:
+            window->handleWheelEvent(QPoint(record.localX, record.localY), QPoint(record.globalX, record.globalY),
+                                     QPoint(record.angleDeltaX, record.angleDeltaY),
+                                     Qt::MouseButtons(record.buttons), Qt::KeyboardModifiers(record.modifiers));
+            break;
+        case InputRing::Record::KeyText: {
+            const int length = qMin<int>(record.textLength, InputRing::Record::MaxTextLength);
+            m_keyText += QStringView(record.text, length);
+            break;
+        }
+        case InputRing::Record::Key: {
+            const int length = qMin<int>(record.textLength, InputRing::Record::MaxTextLength);
+            window->handleKeyEvent(QEvent::Type(record.type), record.key, Qt::KeyboardModifiers(record.modifiers),
+                                   std::exchange(m_keyText, QString()) + QStringView(record.text, length));
+            break;
+        }
+        default:
+            break;
+        }
+    });
+}
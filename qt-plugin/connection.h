@@ -0,0 +1,54 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QHash>
+#include <QRegion>
+
+#include <memory>
+
+#include "fastpath.h"
+#include "inputring.h"
+
+QT_BEGIN_NAMESPACE
+class QSocketNotifier;
+QT_END_NAMESPACE
+
+class PlatformWindow;
+// 与合成器之间的 fastpath 连接，同时持有合成器分配给本客户端的共享内存池
+class Connection
+{
+public:
+    Connection();
+    ~Connection();
+
+    bool connectToCompositor(const QString &clientId, const QByteArray &token);
+    bool isConnected() const;
+    uchar *shmPool() const;
+
+    void addWindow(quint32 surface, PlatformWindow *window);
+    void removeWindow(quint32 surface);
+
+    bool commit(quint32 surface, quint32 buffer, const QRegion &region);
+
+private:
+    void onReadyRead();
+    void dispatch(const FastPath::Header *message, int fd);
+    void disconnect();
+    void setupInputRing(qint64 offset, int fd);
+    void onInputReady();
+
+    int m_socket = -1;
+    std::unique_ptr<QSocketNotifier> m_notifier;
+    uchar *m_shmPool = nullptr;
+    qint64 m_shmPoolSize = 0;
+    QHash<quint32, PlatformWindow*> m_windows;
+
+    // 合成器通过共享内存发送的输入事件
+    InputRing::Header *m_inputRing = nullptr;
+    int m_inputRingFd = -1;
+    std::unique_ptr<QSocketNotifier> m_inputNotifier;
+    // 长文本按键事件中已经收到的前几段
+    QString m_keyText;
+};
@@ -4,6 +4,7 @@
 #include "integration.h"
 #include "platformwindow.h"
 #include "backingstore.h"
+#include "connection.h"
 
 #include <QGuiApplication>
 #include <private/qgenericunixfontdatabase_p.h>
@@ -18,6 +19,8 @@
 
 Integration::Integration() {}
 
+Integration::~Integration() {}
+
 void Integration::initialize()
 {
     m_services.reset(new QGenericUnixServices);
@@ -31,17 +34,21 @@ void Integration::initialize()
 
     m_roManager.reset(m_roNode.acquire<ManagerReplica>());
     m_roManager->waitForSource();
-    auto clientID = m_roManager->createClient();
-    clientID.waitForFinished();
+    auto clientInfo = m_roManager->createClient();
+    clientInfo.waitForFinished();
 
-    qDebug() << "New Client:" << clientID.returnValue();
+    qDebug() << "New Client:" << clientInfo.returnValue().id();
 
-    m_clientId = clientID.returnValue();
+    m_clientId = clientInfo.returnValue().id();
     m_roClient.reset(m_roNode.acquire<ClientReplica>(m_clientId));
     QObject::connect(m_roClient.get(), &ClientReplica::ping, m_roClient.get(), &ClientReplica::pong);
 
     m_roClient->waitForSource();
     m_roClient->pong();
+
+    m_connection.reset(new Connection);
+    if (!m_connection->connectToCompositor(m_clientId, clientInfo.returnValue().token()))
+        qWarning() << "Can't connect to the compositor fastpath, client" << m_clientId;
 }
 
 void Integration::destroy()
@@ -52,6 +59,8 @@ void Integration::destroy()
     if (m_roClient)
         m_roManager->destroyClient(m_clientId);
     m_roManager.reset();
+
+    m_connection.reset();
 }
 
 bool Integration::hasCapability(Capability cap) const
@@ -92,10 +101,11 @@ QPlatformTheme *Integration::createPlatformTheme(const QString &name) const
 QPlatformWindow *Integration::createPlatformWindow(QWindow *window) const
 {
     auto surfaceID = m_roClient->createSurface();
-    return new PlatformWindow(surfaceID, const_cast<QRemoteObjectNode*>(&m_roNode), window);
+    return new PlatformWindow(surfaceID, const_cast<QRemoteObjectNode*>(&m_roNode),
+                              m_connection.get(), window);
 }
 
 QPlatformBackingStore *Integration::createPlatformBackingStore(QWindow *window) const
 {
-    return new BackingStore(window);
+    return new BackingStore(window, m_connection.get());
 }
@@ -7,10 +7,12 @@
 #include <QRemoteObjectNode>
 #include <qpa/qplatformintegration.h>
 
+class Connection;
 class Integration : public QPlatformIntegration
 {
 public:
     Integration();
+    ~Integration();
 
     void initialize() override;
     void destroy() override;
@@ -37,4 +39,6 @@ private:
     std::unique_ptr<ManagerReplica> m_roManager;
     QString m_clientId;
     std::unique_ptr<ClientReplica> m_roClient;
+
+    std::unique_ptr<Connection> m_connection;
 };
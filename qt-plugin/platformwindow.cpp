@@ -2,14 +2,16 @@
 // SPDX-License-Identifier: MIT
 
 #include "platformwindow.h"
+#include "connection.h"
 
 #include <qpa/qwindowsysteminterface.h>
 #include <QGuiApplication>
 #include <QWindow>
 
 PlatformWindow::PlatformWindow(const QRemoteObjectPendingReply<QString> &surfaceID,
-                               QRemoteObjectNode *node, QWindow *window)
+                               QRemoteObjectNode *node, Connection *connection, QWindow *window)
     : QPlatformWindow(window)
+    , m_connection(connection)
     , m_watcher(new QRemoteObjectPendingCallWatcher(surfaceID))
 {
     m_geometry = normalGeometry();
@@ -22,6 +24,7 @@ PlatformWindow::PlatformWindow(const QRemoteObjectPendingReply<QString> &surface
             m_surface.reset(surface);
             m_surface->setGeometry(m_geometry);
             m_surface->setVisible(m_visible);
+            m_connection->addWindow(m_surface->handle(), this);
 
             if (m_surfaceWatcher)
                 m_surfaceWatcher();
@@ -31,6 +34,12 @@ PlatformWindow::PlatformWindow(const QRemoteObjectPendingReply<QString> &surface
     });
 }
 
+PlatformWindow::~PlatformWindow()
+{
+    if (m_surface)
+        m_connection->removeWindow(m_surface->handle());
+}
+
 void PlatformWindow::initialize()
 {
     QPlatformWindow::initialize();
@@ -100,24 +109,96 @@ bool PlatformWindow::isActive() const
     return true;
 }
 
+void PlatformWindow::requestUpdate()
+{
+    if (m_waitingForFrame) {
+        m_updateRequested = true;
+        return;
+    }
+
+    QPlatformWindow::requestUpdate();
+}
+
 void PlatformWindow::setSurfaceWatcher(std::function<void ()> watcher)
 {
     m_surfaceWatcher = watcher;
 }
 
+void PlatformWindow::setBufferWatcher(std::function<void (quint32, bool)> watcher)
+{
+    m_bufferWatcher = watcher;
+}
+
 void PlatformWindow::initForSurface()
 {
+    // 未建立 fastpath 连接时合成器通过 QtRO 信号发送这些事件
     QObject::connect(m_surface.get(), &SurfaceReplica::mouseEvent,
                      [this] (QEvent::Type type, QPoint local, QPoint global,
                              Qt::MouseButton button, Qt::MouseButtons buttons,
                              Qt::KeyboardModifiers modifiers) {
-        qDebug() << "Mouse Event" << type << local << global << button << buttons << modifiers;
-        QWindowSystemInterface::handleMouseEvent(window(), local, global, buttons, button, type, modifiers);
+        handleMouseEvent(type, local, global, button, buttons, modifiers);
+    });
+
+    QObject::connect(m_surface.get(), &SurfaceReplica::wheelEvent,
+                     [this] (QPoint local, QPoint global, QPoint angleDelta,
+                             Qt::MouseButtons buttons, Qt::KeyboardModifiers modifiers) {
+        handleWheelEvent(local, global, angleDelta, buttons, modifiers);
     });
 
     QObject::connect(m_surface.get(), &SurfaceReplica::keyEvent,
                      [this] (QEvent::Type type, int qtkey, Qt::KeyboardModifiers modifiers, QString text) {
-        qDebug() << "Key Event" << type << qtkey << modifiers << text;
-        QWindowSystemInterface::handleKeyEvent(window(), type, qtkey, modifiers, text);
+        handleKeyEvent(type, qtkey, modifiers, text);
+    });
+
+    // 显示状态也可能由合成器改变（例如点击标题栏的关闭按钮），缓冲区随之释放或重新申请
+    QObject::connect(m_surface.get(), &SurfaceReplica::visibleChanged, [this] {
+        if (m_surfaceWatcher)
+            m_surfaceWatcher();
+    });
+
+    QObject::connect(m_surface.get(), &SurfaceReplica::bufferReleased, [this] (quint32 id) {
+        onBufferReleased(id, false);
     });
+
+    // 以合成器的送显节奏驱动 QWindow::requestUpdate
+    QObject::connect(m_surface.get(), &SurfaceReplica::frameDone, [this] {
+        onFrameDone();
+    });
+}
+
+void PlatformWindow::onFrameDone()
+{
+    m_waitingForFrame = false;
+    if (m_updateRequested) {
+        m_updateRequested = false;
+        deliverUpdateRequest();
+    }
+}
+
+void PlatformWindow::onBufferReleased(quint32 id, bool rejected)
+{
+    if (m_bufferWatcher)
+        m_bufferWatcher(id, rejected);
+}
+
+void PlatformWindow::handleMouseEvent(QEvent::Type type, QPoint local, QPoint global,
+                                      Qt::MouseButton button, Qt::MouseButtons buttons,
+                                      Qt::KeyboardModifiers modifiers)
+{
+    qDebug() << "Mouse Event" << type << local << global << button << buttons << modifiers;
+    QWindowSystemInterface::handleMouseEvent(window(), local, global, buttons, button, type, modifiers);
+}
+
+void PlatformWindow::handleWheelEvent(QPoint local, QPoint global, QPoint angleDelta,
+                                      Qt::MouseButtons buttons, Qt::KeyboardModifiers modifiers)
+{
+    Q_UNUSED(buttons)
+    QWindowSystemInterface::handleWheelEvent(window(), local, global, QPoint(), angleDelta, modifiers);
+}
+
+void PlatformWindow::handleKeyEvent(QEvent::Type type, int qtkey, Qt::KeyboardModifiers modifiers,
+                                    const QString &text)
+{
+    qDebug() << "Key Event" << type << qtkey << modifiers << text;
+    QWindowSystemInterface::handleKeyEvent(window(), type, qtkey, modifiers, text);
 }
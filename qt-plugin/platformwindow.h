@@ -6,12 +6,15 @@
 #include "rep_kernel_replica.h"
 #include <qpa/qplatformwindow.h>
 
+class Connection;
 class PlatformWindow : public QPlatformWindow
 {
     friend class BackingStore;
+    friend class Connection;
 public:
     explicit PlatformWindow(const QRemoteObjectPendingReply<QString> &surfaceID,
-                            QRemoteObjectNode *node, QWindow *window);
+                            QRemoteObjectNode *node, Connection *connection, QWindow *window);
+    ~PlatformWindow();
 
     void initialize() override;
 
@@ -31,15 +34,35 @@ public:
     bool isExposed() const override;
     bool isActive() const override;
 
+    void requestUpdate() override;
+
     void setSurfaceWatcher(std::function<void()> watcher);
+    // 合成器归还缓冲区或拒绝提交（rejected 为 true）时调用
+    void setBufferWatcher(std::function<void(quint32 id, bool rejected)> watcher);
 
 private:
     void initForSurface();
+    void onFrameDone();
+    void onBufferReleased(quint32 id, bool rejected);
+
+    // QtRO 与 fastpath 收到的输入事件都经由这里投递
+    void handleMouseEvent(QEvent::Type type, QPoint local, QPoint global,
+                          Qt::MouseButton button, Qt::MouseButtons buttons,
+                          Qt::KeyboardModifiers modifiers);
+    void handleWheelEvent(QPoint local, QPoint global, QPoint angleDelta,
+                          Qt::MouseButtons buttons, Qt::KeyboardModifiers modifiers);
+    void handleKeyEvent(QEvent::Type type, int qtkey, Qt::KeyboardModifiers modifiers,
+                        const QString &text);
 
     QRect m_geometry;
     bool m_visible = false;
+    // 已提交的帧还未送显，期间的 requestUpdate 推迟到 frameDone 之后
+    bool m_waitingForFrame = false;
+    bool m_updateRequested = false;
 
+    Connection *m_connection;
     std::function<void()> m_surfaceWatcher;
+    std::function<void(quint32, bool)> m_bufferWatcher;
     std::unique_ptr<SurfaceReplica> m_surface;
     std::unique_ptr<QRemoteObjectPendingCallWatcher> m_watcher;
 };
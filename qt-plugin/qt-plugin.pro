@@ -4,6 +4,7 @@ PLUGIN_CLASS_NAME = X.STONE
 
 QT       += core-private gui-private remoteobjects
 REPC_REPLICA = ../protocols/kernel.rep
+INCLUDEPATH += ../protocols
 
 TEMPLATE = lib
 CONFIG += plugin
@@ -21,11 +22,16 @@ INSTALLS += target
 
 SOURCES += \
     backingstore.cpp \
+    connection.cpp \
     integration.cpp \
     main.cpp \
     platformwindow.cpp
 
 HEADERS += \
+    ../protocols/fastpath.h \
+    ../protocols/inputring.h \
+    ../protocols/shm.h \
     backingstore.h \
+    connection.h \
     integration.h \
     platformwindow.h
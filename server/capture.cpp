@@ -0,0 +1,220 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#include "capture.h"
+#include "output.h"
+#include "shmpool.h"
+#include "shm.h"
+
+#include <QPainter>
+#include <QTimerEvent>
+#include <QDebug>
+
+#include <cstring>
+
+Capture::Capture(QObject *parent)
+    : QObject(parent)
+{
+
+}
+
+Capture::~Capture()
+{
+    if (!m_shmPool)
+        return;
+
+    for (quint32 id : std::as_const(m_bufferIds))
+        m_shmPool->free(m_buffers.pointer(id)->shm.offset);
+}
+
+void Capture::setSources(const QList<Source> &sources)
+{
+    m_sources = sources;
+    m_bounds = QRect();
+    for (const auto &source : sources)
+        m_bounds |= source.geometry;
+    m_format = sources.isEmpty() ? QImage::Format_Invalid : sources.first().image->format();
+
+    m_frameDamage.setBounds(m_bounds);
+    m_frameDamage += m_bounds;
+}
+
+QSize Capture::size() const
+{
+    return m_bounds.size();
+}
+
+QImage::Format Capture::format() const
+{
+    return m_format;
+}
+
+void Capture::setShmPool(const std::shared_ptr<ShmPool> &pool)
+{
+    Q_ASSERT(m_buffers.isEmpty());
+    m_shmPool = pool;
+}
+
+Capture::SharedBuffer Capture::createBuffer()
+{
+    if (!m_shmPool || m_bounds.isEmpty() || m_format == QImage::Format_Invalid)
+        return {};
+
+    Buffer buffer;
+    buffer.shm.size = m_bounds.size();
+    buffer.shm.bytesPerLine = (m_bounds.width() * QImage::toPixelFormat(m_format).bitsPerPixel() / 8 + 3) & ~3;
+    buffer.shm.offset = m_shmPool->allocate(Shm::HeaderSize
+                                            + qint64(buffer.shm.bytesPerLine) * m_bounds.height());
+    if (buffer.shm.offset < 0) {
+        qWarning() << "Can't allocate capture buffer for" << this;
+        return {};
+    }
+
+    // 新的缓冲区需要写入完整的一帧
+    buffer.damage.setBounds(m_bounds);
+    buffer.damage += m_bounds;
+
+    buffer.shm.id = m_buffers.insert(buffer);
+    if (!buffer.shm.id) {
+        m_shmPool->free(buffer.shm.offset);
+        return {};
+    }
+    m_buffers.pointer(buffer.shm.id)->shm.id = buffer.shm.id;
+    m_bufferIds.append(buffer.shm.id);
+
+    // 客户端提交之后合成器才会写入
+    Shm::releaseBuffer(Shm::bufferHeader(m_shmPool->data(), buffer.shm.offset));
+
+    return buffer.shm;
+}
+
+void Capture::destroyBuffer(quint32 id)
+{
+    if (auto buffer = m_buffers.pointer(id)) {
+        m_shmPool->free(buffer->shm.offset);
+        m_buffers.remove(id);
+        m_bufferIds.removeOne(id);
+    }
+}
+
+void Capture::queueBuffer(quint32 id)
+{
+    auto buffer = m_buffers.pointer(id);
+    if (!buffer || !Shm::isCompositorOwned(Shm::bufferHeader(m_shmPool->data(), buffer->shm.offset)))
+        return;
+
+    deliver();
+}
+
+bool Capture::isActive() const
+{
+    return m_active;
+}
+
+void Capture::start(int maxFps)
+{
+    m_frameInterval = maxFps > 0 ? 1000000000 / maxFps : 0;
+    if (m_active)
+        return;
+
+    m_active = true;
+    // 停止期间的变化没有记录，第一帧需要完整的内容
+    m_frameDamage += m_bounds;
+    for (quint32 id : std::as_const(m_bufferIds))
+        m_buffers.pointer(id)->damage += m_bounds;
+
+    deliver();
+}
+
+void Capture::stop()
+{
+    m_active = false;
+    m_timer.stop();
+}
+
+void Capture::addFrame(const QRegion &damage)
+{
+    if (!m_active)
+        return;
+
+    m_frameDamage += damage;
+    for (quint32 id : std::as_const(m_bufferIds))
+        m_buffers.pointer(id)->damage += damage;
+
+    deliver();
+}
+
+void Capture::deliver()
+{
+    if (!m_active || m_frameDamage.isEmpty() || m_timer.isActive())
+        return;
+
+    // 帧率限制，期间的变化留到下一帧
+    const qint64 now = Output::monotonicTime();
+    const qint64 wait = m_lastFrameTime + m_frameInterval - now;
+    if (wait > 0) {
+        m_timer.start(int((wait + 999999) / 1000000), Qt::PreciseTimer, this);
+        return;
+    }
+
+    Buffer *target = nullptr;
+    for (quint32 id : std::as_const(m_bufferIds)) {
+        auto buffer = m_buffers.pointer(id);
+        if (Shm::isCompositorOwned(Shm::bufferHeader(m_shmPool->data(), buffer->shm.offset))) {
+            target = buffer;
+            break;
+        }
+    }
+
+    // 客户端来不及处理，变化留在 m_frameDamage 中，等 queueBuffer 再写入
+    if (!target)
+        return;
+
+    copy(target);
+    target->damage.clear();
+    Shm::releaseBuffer(Shm::bufferHeader(m_shmPool->data(), target->shm.offset));
+
+    const QRegion damage = m_frameDamage.region();
+    m_frameDamage.clear();
+    m_lastFrameTime = now;
+
+    emit frameReady(target->shm.id, damage, now);
+}
+
+void Capture::copy(Buffer *buffer)
+{
+    QImage target(Shm::bufferData(m_shmPool->data(), buffer->shm.offset),
+                  buffer->shm.size.width(), buffer->shm.size.height(),
+                  buffer->shm.bytesPerLine, m_format);
+    const int bpp = target.depth() / 8;
+
+    for (const QRect &r : buffer->damage.rects()) {
+        for (const auto &source : std::as_const(m_sources)) {
+            const QRect part = r & source.geometry;
+            if (part.isEmpty())
+                continue;
+
+            const QPoint from = part.topLeft() - source.geometry.topLeft();
+            if (source.image->format() == m_format) {
+                for (int y = 0; y < part.height(); ++y) {
+                    memcpy(target.scanLine(part.top() - m_bounds.top() + y) + (part.left() - m_bounds.left()) * bpp,
+                           source.image->constScanLine(from.y() + y) + from.x() * bpp,
+                           part.width() * bpp);
+                }
+            } else {
+                QPainter pa(&target);
+                pa.setCompositionMode(QPainter::CompositionMode_Source);
+                pa.drawImage(part.topLeft() - m_bounds.topLeft(), *source.image, QRect(from, part.size()));
+            }
+        }
+    }
+}
+
+void Capture::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() != m_timer.timerId())
+        return QObject::timerEvent(event);
+
+    m_timer.stop();
+    deliver();
+}
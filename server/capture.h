@@ -0,0 +1,90 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QObject>
+#include <QBasicTimer>
+#include <QImage>
+#include <QRegion>
+
+#include <memory>
+
+#include "handletable.h"
+#include "tiledamage.h"
+
+class ShmPool;
+// 录屏的合成器一侧：每帧合成后把桌面中变化的部分复制到客户端共享内存池中的
+// 缓冲区。缓冲区的所有权与窗口的缓冲区一样通过头部移交：客户端提交后合成器
+// 才会写入，写完后归还并发出 frameReady。没有可用的缓冲区时只累积损坏区域，
+// 客户端通过 queueBuffer 交还缓冲区时再写入，合成器从不等待客户端
+class Capture : public QObject
+{
+    Q_OBJECT
+public:
+    // 合成结果中的一块，geometry 为其在桌面中的位置
+    struct Source {
+        const QImage *image;
+        QRect geometry;
+    };
+
+    struct SharedBuffer {
+        quint32 id = 0;
+        qint64 offset = -1;
+        QSize size;
+        int bytesPerLine = 0;
+    };
+
+    explicit Capture(QObject *parent = nullptr);
+    ~Capture();
+
+    // 由合成器设置，桌面的大小和像素格式由此决定
+    void setSources(const QList<Source> &sources);
+    QSize size() const;
+    QImage::Format format() const;
+
+    void setShmPool(const std::shared_ptr<ShmPool> &pool);
+    SharedBuffer createBuffer();
+    void destroyBuffer(quint32 id);
+    // 客户端已提交缓冲区，有积压的变化时立即写入
+    void queueBuffer(quint32 id);
+
+    bool isActive() const;
+    // maxFps 为 0 时不限制帧率
+    void start(int maxFps);
+    void stop();
+
+    // 合成器每合成一帧调用一次，damage 为桌面坐标
+    void addFrame(const QRegion &damage);
+
+signals:
+    // damage 为与上一次发出的帧相比变化的区域
+    void frameReady(quint32 id, QRegion damage, qint64 timestamp);
+
+private:
+    struct Buffer {
+        SharedBuffer shm;
+        // 这个缓冲区上一次写入之后变化的区域
+        TileDamage damage;
+    };
+
+    void deliver();
+    void copy(Buffer *buffer);
+    void timerEvent(QTimerEvent *event) override;
+
+    QList<Source> m_sources;
+    QRect m_bounds;
+    QImage::Format m_format = QImage::Format_Invalid;
+
+    std::shared_ptr<ShmPool> m_shmPool;
+    HandleTable<Buffer> m_buffers;
+    QList<quint32> m_bufferIds;
+
+    bool m_active = false;
+    // 单位均为纳秒
+    qint64 m_frameInterval = 0;
+    qint64 m_lastFrameTime = 0;
+    TileDamage m_frameDamage;
+    // 只用于帧率限制
+    QBasicTimer m_timer;
+};
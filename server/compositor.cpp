@@ -5,16 +5,27 @@
 #include "output.h"
 #include "virtualoutput.h"
 #include "input.h"
+#include "shmpool.h"
+#include "shm.h"
+#include "drawcommands.h"
+#include "textcache.h"
+#include "solidfill.h"
+#include "scanout.h"
+#include "capture.h"
 
 #include <QGuiApplication>
 #include <QEvent>
 #include <QKeyEvent>
+#include <QTimerEvent>
 #include <QPainter>
+#include <QFontMetrics>
 #include <QDebug>
 
 #include <private/qfbvthandler_p.h>
 #include <private/qcore_unix_p.h>
 
+#include <cstring>
+#include <utility>
 #include <unistd.h>
 #include <fcntl.h>
 #include <linux/kd.h>
@@ -37,9 +48,25 @@ private:
             auto key = static_cast<QKeyEvent*>(event);
             if (key->key() == Qt::Key_Escape)
                 qApp->quit();
+            // Ctrl+Alt+D 切换损坏区域的调试显示
+            if (key->key() == Qt::Key_D
+                && (key->modifiers() & (Qt::ControlModifier | Qt::AltModifier))
+                       == (Qt::ControlModifier | Qt::AltModifier)) {
+                if (!key->isAutoRepeat())
+                    compositor()->setDamageDebug(!compositor()->isDamageDebug());
+                m_swallowKeyRelease = Qt::Key_D;
+                return true;
+            }
             Q_FALLTHROUGH();
         }
         case QEvent::KeyRelease: {
+            // 快捷键的按下没有发给窗口，对应的释放也不发
+            if (event->type() == QEvent::KeyRelease
+                && static_cast<QKeyEvent*>(event)->key() == m_swallowKeyRelease) {
+                if (!static_cast<QKeyEvent*>(event)->isAutoRepeat())
+                    m_swallowKeyRelease = 0;
+                return true;
+            }
             if (compositor()->m_focusWindow)
                 qApp->sendEvent(compositor()->m_focusWindow.get(), event);
             break;
@@ -67,8 +94,137 @@ private:
 
         return Input::event(event);
     }
+
+    // 被合成器当作快捷键处理的按键
+    int m_swallowKeyRelease = 0;
 };
 
+// 文本绘制到的区域，多行文本在 bounds 内换行
+static QRect textBoundingRect(QPainter *painter, QPoint pos, const QString &text, const QRect &bounds)
+{
+    if (TextCache::isSingleLine(text))
+        return TextCache::instance()->boundingRect(painter->font(), pos, text);
+
+    return painter->boundingRect(pos.x(), pos.y(),
+                                 bounds.width() - pos.x(),
+                                 bounds.height() - pos.y(),
+                                 0, text);
+}
+
+// 回放 display list，只执行与 region 相交的命令
+class DisplayListPainter
+{
+public:
+    DisplayListPainter(QPainter *painter, const QRegion &region, const QRect &bounds)
+        : m_painter(painter)
+        , m_region(region)
+        , m_bounds(bounds) {}
+
+    void fillRect(QRect rect, QColor color) {
+        if (!m_region.intersects(rect))
+            return;
+        SolidFill::fillRect(m_painter, rect, color);
+    }
+
+    void drawText(QPoint pos, QString text, QColor color) {
+        const QRect textRect = textBoundingRect(m_painter, pos, text, m_bounds);
+        if (!m_region.intersects(textRect))
+            return;
+
+        if (TextCache::isSingleLine(text)
+            && TextCache::instance()->drawText(m_painter, pos, text, color, m_region & m_bounds)) {
+            return;
+        }
+
+        m_painter->setBrush(Qt::NoBrush);
+        m_painter->setPen(color);
+        m_painter->drawText(textRect, text);
+    }
+
+private:
+    QPainter *m_painter;
+    QRegion m_region;
+    QRect m_bounds;
+};
+
+// 只用于检查命令是否合法
+struct DrawCommandsValidator
+{
+    void fillRect(QRect, QColor) {}
+    void drawText(QPoint, QString, QColor) {}
+};
+
+// 记下 display list 中每条命令及其绘制到的区域，用于比较两份 display list
+class DisplayListRecorder
+{
+public:
+    struct Command {
+        DrawCommands::Type type;
+        QRect rect;
+        QString text;
+        QRgb color;
+        // 不受窗口区域裁剪
+        QRect bounds;
+
+        bool operator==(const Command &other) const {
+            return type == other.type && rect == other.rect && text == other.text
+                   && color == other.color && bounds == other.bounds;
+        }
+    };
+
+    DisplayListRecorder(QPainter *painter, const QRect &bounds)
+        : m_painter(painter)
+        , m_bounds(bounds) {}
+
+    void fillRect(QRect rect, QColor color) {
+        m_commands.append({ DrawCommands::FillRect, rect, QString(), color.rgba(), rect });
+    }
+
+    void drawText(QPoint pos, QString text, QColor color) {
+        m_commands.append({ DrawCommands::DrawText, QRect(pos, QSize()), text, color.rgba(),
+                            textBoundingRect(m_painter, pos, text, m_bounds) });
+    }
+
+    const QList<Command> &commands() const {
+        return m_commands;
+    }
+
+private:
+    QPainter *m_painter;
+    QRect m_bounds;
+    QList<Command> m_commands;
+};
+
+// 在 from 的区域内回放 oldList 与在 to 的区域内回放 newList，结果在 to 中可能
+// 不同的区域。像素的内容只取决于覆盖它的命令序列，所以逐条比较命令，只有
+// 不同的命令覆盖到的地方才会变化
+static QRegion displayListDamage(const QByteArray &oldList, const QRect &from,
+                                 const QByteArray &newList, const QRect &to)
+{
+    // 与回放时使用同样的字体度量
+    static QImage device(1, 1, Window::BufferFormat);
+    QPainter pa(&device);
+
+    DisplayListRecorder oldCommands(&pa, from);
+    DisplayListRecorder newCommands(&pa, to);
+    DrawCommands::forEach(oldList, oldCommands);
+    DrawCommands::forEach(newList, newCommands);
+
+    const auto &a = oldCommands.commands();
+    const auto &b = newCommands.commands();
+    TileDamage damage(to);
+    for (int i = 0; i < qMax(a.size(), b.size()); ++i) {
+        if (i < a.size() && i < b.size() && a.at(i) == b.at(i))
+            continue;
+        if (i < a.size())
+            damage += a.at(i).bounds;
+        if (i < b.size())
+            damage += b.at(i).bounds;
+    }
+
+    return damage.region();
+}
+
 static bool setConsoleMode(int mode)
 {
     bool ok = false;
@@ -94,6 +250,12 @@ Compositor::Compositor(QObject *parent)
 
 Compositor::~Compositor()
 {
+    // 先停止送显线程，它们还在使用 Output。没能停止的线程仍在使用的 Output 不释放
+    for (int i = 0; i < m_scanouts.count(); ++i) {
+        if (!m_scanouts.at(i)->stop())
+            m_outputs[i] = nullptr;
+    }
+    qDeleteAll(m_scanouts);
     qDeleteAll(m_outputs);
     setConsoleMode(KD_TEXT);
 }
@@ -123,6 +285,9 @@ void Compositor::start()
         }
 
         m_outputs << o;
+        auto scanout = new Scanout(o);
+        connect(scanout, &Scanout::finished, this, &Compositor::onScanoutFinished);
+        m_scanouts << scanout;
     }
 
     if (m_outputs.isEmpty()) {
@@ -140,8 +305,29 @@ void Compositor::start()
     }
 
     auto primaryOutput = m_outputs.isEmpty() ? nullptr : m_outputs.first();
-    const QRect bufferRect = m_virtualOutput ? m_virtualOutput->rect() : primaryOutput->rect();
-    m_input->setCursorBoundsRect(bufferRect);
+    QRect primaryRect;
+
+    if (primaryOutput && qEnvironmentVariable("XSTONE_OUTPUT_LAYOUT") == QLatin1String("extended")) {
+        // 扩展模式：屏幕按顺序从左到右排列，每个屏幕只合成桌面中属于自己的部分
+        m_outputLayout = OutputLayout::Extended;
+        int x = 0;
+        for (auto o : std::as_const(m_outputs)) {
+            OutputView &view = m_outputViews[o];
+            view.geometry = QRect(QPoint(x, 0), o->size());
+            view.buffer = QImage(o->size(), o->format());
+            x += o->width();
+            m_desktopRect |= view.geometry;
+        }
+        primaryRect = m_outputViews.value(primaryOutput).geometry;
+    } else {
+        m_desktopRect = m_virtualOutput ? m_virtualOutput->rect() : primaryOutput->rect();
+        m_buffer = QImage(m_desktopRect.size(),
+                          m_virtualOutput ? QImage::Format_RGB888 : primaryOutput->format());
+        primaryRect = m_desktopRect;
+    }
+
+    m_input->setCursorBoundsRect(m_desktopRect);
+    m_pendingDamage.setBounds(m_desktopRect);
 
     Q_ASSERT(!m_rootNode);
     m_rootNode = new RootNode(this);
@@ -153,101 +339,345 @@ void Compositor::start()
         m_cursorNode->move(m_input->cursorPosition());
     });
 
-    m_input->setCursorPosition(bufferRect.center());
-    m_buffer = QImage(bufferRect.size(),
-                      m_virtualOutput ? QImage::Format_RGB888 : primaryOutput->format());
+    m_input->setCursorPosition(primaryRect.center());
 
     paint();
 }
 
-void Compositor::paint(const QRegion &region)
+// 把桌面中 geometry 区域的内容合成到 buffer，region 为空时合成整个区域
+bool Compositor::composite(QImage *buffer, const QRect &geometry, const QRegion &region,
+                           QImage *wallpaper)
 {
-    Q_ASSERT(!m_painting);
-    if (m_outputs.isEmpty() && !m_virtualOutput)
-        return;
-
-    if (m_buffer.isNull())
-        return;
+    if (buffer->isNull())
+        return false;
 
-    QPainter pa(&m_buffer);
+    QPainter pa(buffer);
     if (!pa.isActive())
-        return;
+        return false;
 
-    m_painting = true;
     pa.setBackground(m_background);
     pa.setBackgroundMode(Qt::OpaqueMode);
+    // 以桌面坐标绘制
+    pa.translate(-geometry.topLeft());
 
     if (!region.isEmpty())
         pa.setClipRegion(region);
 
     // 绘制壁纸
     if (!m_wallpaper.isNull()) {
-        if (m_wallpaperWithPrimaryOutput.isNull()
-            || m_wallpaperWithPrimaryOutput.width() != m_buffer.width()) {
-            const auto tmpRect = QRect(QPoint(0, 0), m_buffer.size().scaled(m_wallpaper.size(),
-                                                                                  Qt::KeepAspectRatio));
-            m_wallpaperWithPrimaryOutput = m_wallpaper.copy(tmpRect);
-            m_wallpaperWithPrimaryOutput = m_wallpaperWithPrimaryOutput.scaled(m_buffer.size(),
-                                                                               Qt::IgnoreAspectRatio,
-                                                                               Qt::SmoothTransformation);
+        if (wallpaper->isNull() || wallpaper->size() != geometry.size()) {
+            const auto tmpRect = QRect(QPoint(0, 0), geometry.size().scaled(m_wallpaper.size(),
+                                                                             Qt::KeepAspectRatio));
+            *wallpaper = m_wallpaper.copy(tmpRect);
+            *wallpaper = wallpaper->scaled(geometry.size(),
+                                           Qt::IgnoreAspectRatio,
+                                           Qt::SmoothTransformation);
         }
 
     }
 
-    pa.drawImage(0, 0, m_wallpaperWithPrimaryOutput);
+    // 没有壁纸时用背景色填充
+    if (wallpaper->isNull())
+        SolidFill::fillRect(&pa, geometry, m_background);
+    else
+        pa.drawImage(geometry.topLeft(), *wallpaper);
     pa.setBackgroundMode(Qt::TransparentMode);
 
     // 绘制窗口
-    m_rootNode->setGeometry(m_buffer.rect());
     m_rootNode->draw(&pa);
-    pa.end();
 
-    // for debug
-    // int i = 0;
-    // m_buffer.save(QString("/tmp/zccrs/%1.png").arg(++i));
+    if (m_damageDebug)
+        paintDamageMarks(&pa);
 
-    // 送显
-    for (int i = 0; i < m_outputs.count(); ++i) {
-        auto o = m_outputs.at(i);
-        if (!o->waitForVSync())
+    return true;
+}
+
+// 标记的名称绘制在损坏区域包围盒的左上角，可能超出损坏区域
+static QRect damageMarkLabelRect(const QRect &bounds, const QString &origin)
+{
+    const QFontMetrics fm((QFont()));
+    return fm.boundingRect(origin).translated(bounds.topLeft() + QPoint(2, fm.ascent() + 1))
+        .adjusted(-1, -1, 1, 1);
+}
+
+void Compositor::paintDamageMarks(QPainter *pa)
+{
+    const qint64 now = Output::monotonicTime();
+    const QFontMetrics fm((QFont()));
+    pa->setFont(QFont());
+
+    for (const auto &mark : std::as_const(m_damageMarks)) {
+        const qreal life = 1.0 - qreal(now - mark.time) / DamageMarkDuration;
+        if (life <= 0)
             continue;
 
-        pa.begin(o);
-        pa.setBackground(m_background);
-        pa.setBackgroundMode(Qt::OpaqueMode);
-        pa.setCompositionMode(QPainter::CompositionMode_Source);
-        pa.setRenderHint(QPainter::SmoothPixmapTransform);
+        // 同一个节点的标记使用同一种颜色
+        QColor color = QColor::fromHsv(qHash(mark.origin) % 360, 255, 255);
+        color.setAlphaF(0.4 * life);
+        for (const QRect &r : mark.region)
+            pa->fillRect(r, color);
+
+        color.setAlphaF(life);
+        const QRect bounds = mark.region.boundingRect();
+        pa->setPen(color);
+        pa->setBrush(Qt::NoBrush);
+        pa->drawRect(bounds.adjusted(0, 0, -1, -1));
+        pa->drawText(bounds.topLeft() + QPoint(2, fm.ascent() + 1), mark.origin);
+    }
+}
 
-        QRect targetRect = m_buffer.rect();
-        // 等比缩放到目标屏幕
-        targetRect.setSize(targetRect.size().scaled(o->size(), Qt::KeepAspectRatio));
-        //  居中显示
-        targetRect.moveCenter(o->rect().center());
+// 渐隐中的标记每帧都要重绘，已经消失的标记再重绘一次以清除
+void Compositor::updateDamageMarks()
+{
+    const qint64 now = Output::monotonicTime();
+    for (auto it = m_damageMarks.begin(); it != m_damageMarks.end();) {
+        m_pendingDamage += it->area;
+        if (now - it->time >= DamageMarkDuration)
+            it = m_damageMarks.erase(it);
+        else
+            ++it;
+    }
+}
 
-        if (region.isEmpty()) {
-            pa.drawImage(targetRect, m_buffer, m_buffer.rect());
-        } else {
-            QTransform mapToOutput;
-            mapToOutput.scale(qreal(targetRect.width()) / m_buffer.width(),
-                              qreal(targetRect.height()) / m_buffer.height());
-            mapToOutput.translate(targetRect.x(), targetRect.y());
+bool Compositor::isDamageDebug() const
+{
+    return m_damageDebug;
+}
 
-            for (const QRect &r : region) {
-                pa.drawImage(mapToOutput.mapRect(r), m_buffer, r);
+void Compositor::setDamageDebug(bool enabled)
+{
+    if (m_damageDebug == enabled)
+        return;
+
+    m_damageDebug = enabled;
+    if (!enabled) {
+        for (const auto &mark : std::as_const(m_damageMarks))
+            m_pendingDamage += mark.area;
+        m_damageMarks.clear();
+        scheduleFrame();
+    }
+}
+
+void Compositor::paint(const QRegion &region)
+{
+    Q_ASSERT(!m_painting);
+    Q_ASSERT(m_pendingScanouts == 0);
+    if (m_outputs.isEmpty() && !m_virtualOutput)
+        return;
+
+    m_painting = true;
+    const qint64 startTime = Output::monotonicTime();
+    m_rootNode->setGeometry(m_desktopRect);
+    m_scannedOutputs.clear();
+
+    if (m_outputLayout == OutputLayout::Extended) {
+        for (int i = 0; i < m_outputs.count(); ++i) {
+            OutputView &view = m_outputViews[m_outputs.at(i)];
+            // 与本屏幕不相交的更新既不合成也不送显
+            const QRegion outputRegion = region.isEmpty() ? QRegion(view.geometry)
+                                                          : region & view.geometry;
+            if (outputRegion.isEmpty())
+                continue;
+
+            if (!composite(&view.buffer, view.geometry, outputRegion, &view.wallpaper))
+                continue;
+
+            if (m_scanouts.at(i)->submit(view.buffer, outputRegion.translated(-view.geometry.topLeft()))) {
+                ++m_pendingScanouts;
+                m_scannedOutputs << m_outputs.at(i);
+            }
+        }
+    } else if (composite(&m_buffer, m_buffer.rect(), region, &m_wallpaperWithPrimaryOutput)) {
+        // for debug
+        // int i = 0;
+        // m_buffer.save(QString("/tmp/zccrs/%1.png").arg(++i));
+
+        // 送显，各个屏幕在自己的线程中同时等待 vblank
+        // 没有响应的屏幕不计入，不拖慢其它屏幕
+        for (auto scanout : std::as_const(m_scanouts)) {
+            if (scanout->submit(m_buffer, region)) {
+                ++m_pendingScanouts;
+                m_scannedOutputs << scanout->output();
             }
         }
-    }
 
-    if (m_virtualOutput) {
-        m_virtualOutput->setImage(&m_buffer);
+        if (m_virtualOutput) {
+            m_virtualOutput->setImage(&m_buffer);
+        }
     }
 
     m_painting = false;
+
+    if (!m_captures.isEmpty()) {
+        const QRegion damage = region.isEmpty() ? QRegion(m_desktopRect) : region;
+        for (auto capture : std::as_const(m_captures))
+            capture->addFrame(damage);
+    }
+
+    // 合成耗时的指数移动平均，只计入主线程上的工作
+    const qint64 cost = Output::monotonicTime() - startTime;
+    m_compositeCost += (cost - m_compositeCost) / 4;
+
+    if (!m_damageMarks.isEmpty())
+        updateDamageMarks();
+
+    if (m_pendingScanouts == 0) {
+        framePresented();
+        scheduleFrame();
+    }
 }
 
 void Compositor::paint()
 {
-    paint({});
+    markDirty(m_desktopRect);
+}
+
+// 晚于 now 的第一个 vblank 的预计时间
+static qint64 nextVSyncTime(const Output *output, qint64 now)
+{
+    const qint64 interval = output->refreshInterval();
+    return now - (now - output->lastVSyncTime()) % interval + interval;
+}
+
+// 送显期间的更新合并起来，在所有屏幕送显完成后作为下一帧绘制。开始合成的
+// 时间尽量推迟到下一个 vblank 之前刚好来得及的时刻，期间到达的更新一并绘制，
+// 使送显的内容尽可能新
+void Compositor::scheduleFrame()
+{
+    if (m_pendingScanouts > 0 || m_frameTimer.isActive()
+        || (m_pendingDamage.isEmpty() && !m_frameRequested)) {
+        return;
+    }
+
+    // 虚拟屏没有 vblank，立即绘制
+    if (m_outputs.isEmpty()) {
+        m_frameTimer.start(0, this);
+        return;
+    }
+
+    const qint64 now = Output::monotonicTime();
+    const qint64 budget = m_compositeCost + FrameMargin;
+    const QRect damageRect = m_pendingDamage.isEmpty() ? m_desktopRect
+                                                       : m_pendingDamage.region().boundingRect();
+
+    // 跟随这一帧要更新的屏幕中最早的 vblank，没有响应的屏幕不计入。都没有
+    // 响应时仍按主屏的节奏绘制
+    Output *target = nullptr;
+    qint64 nextVSync = 0;
+    for (int i = 0; i < m_outputs.count(); ++i) {
+        Output *output = m_outputs.at(i);
+        if (!m_scanouts.at(i)->isResponsive() || !isShownOn(output, damageRect))
+            continue;
+
+        qint64 vsync = nextVSyncTime(output, now);
+        // 已经赶不上这个 vblank，按下一个计算
+        if (vsync - budget < now)
+            vsync += output->refreshInterval();
+        if (!target || vsync < nextVSync) {
+            target = output;
+            nextVSync = vsync;
+        }
+    }
+
+    if (!target) {
+        target = m_outputs.first();
+        nextVSync = nextVSyncTime(target, now);
+        if (nextVSync - budget < now)
+            nextVSync += target->refreshInterval();
+    }
+
+    const qint64 interval = target->refreshInterval();
+    const qint64 delay = (nextVSync - budget - now) / 1000000;
+    m_frameTimer.start(int(qBound<qint64>(0, delay, interval / 1000000)), Qt::PreciseTimer, this);
+}
+
+bool Compositor::isShownOn(Output *output, const QRect &rect) const
+{
+    if (m_outputLayout != OutputLayout::Extended)
+        return true;
+    return m_outputViews.value(output).geometry.intersects(rect);
+}
+
+void Compositor::onScanoutFinished()
+{
+    Q_ASSERT(m_pendingScanouts > 0);
+    if (--m_pendingScanouts > 0)
+        return;
+
+    framePresented();
+    scheduleFrame();
+}
+
+void Compositor::framePresented()
+{
+    const qint64 now = Output::monotonicTime();
+
+    // 通知客户端上一帧已经送显，客户端据此控制绘制的节奏
+    for (auto node : std::as_const(m_rootNode->m_orderedChildren)) {
+        auto window = qobject_cast<Window*>(node);
+        if (!window || !window->isVisible())
+            continue;
+
+        qint64 presentTime = now;
+        qint64 refreshInterval = Output::DefaultRefreshInterval;
+        presentTiming(window->geometry(), now, &presentTime, &refreshInterval);
+        window->framePresented(presentTime, refreshInterval);
+    }
+}
+
+// 只看显示了 rect 的屏幕：以其中这一帧送显了的屏幕最晚的 vblank 为准；都没有
+// 送显时上一个 vblank 可能早于窗口的提交，使用仍有响应的屏幕预计的下一个
+// vblank。虚拟屏没有 vblank，使用当前时间
+void Compositor::presentTiming(const QRect &rect, qint64 now, qint64 *time, qint64 *interval) const
+{
+    Output *scanned = nullptr;
+    Output *idle = nullptr;
+    for (int i = 0; i < m_outputs.count(); ++i) {
+        Output *output = m_outputs.at(i);
+        if (!isShownOn(output, rect))
+            continue;
+
+        if (m_scannedOutputs.contains(output)) {
+            if (!scanned || output->lastVSyncTime() > scanned->lastVSyncTime())
+                scanned = output;
+        } else if (!idle && m_scanouts.at(i)->isResponsive()) {
+            idle = output;
+        }
+    }
+
+    if (scanned) {
+        *time = scanned->lastVSyncTime();
+        *interval = scanned->refreshInterval();
+    } else if (idle) {
+        *time = nextVSyncTime(idle, now);
+        *interval = idle->refreshInterval();
+    }
+}
+
+void Compositor::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() != m_frameTimer.timerId())
+        return QObject::timerEvent(event);
+
+    m_frameTimer.stop();
+    m_frameRequested = false;
+
+    // 合并后的指针移动事件每帧发给客户端一次，客户端赶在这一帧之后绘制
+    for (auto node : std::as_const(m_rootNode->m_orderedChildren)) {
+        if (auto window = qobject_cast<Window*>(node))
+            window->flushMotion();
+    }
+
+    // 只是为了通知窗口，不必合成
+    if (m_pendingDamage.isEmpty()) {
+        m_scannedOutputs.clear();
+        framePresented();
+        return;
+    }
+
+    const QRegion region = m_pendingDamage.region();
+    m_pendingDamage.clear();
+    paint(region);
 }
 
 void Compositor::setFocusWindow(Window *window)
@@ -282,16 +712,38 @@ void Compositor::setBackground(const QColor &newBackground)
 void Compositor::setWallpaper(const QImage &image)
 {
     m_wallpaper = image;
+    // 丢弃按旧壁纸缩放的缓存
+    m_wallpaperWithPrimaryOutput = QImage();
+    for (auto &view : m_outputViews)
+        view.wallpaper = QImage();
     paint();
 }
 
-void Compositor::markDirty(const QRegion &region)
+void Compositor::markDirty(const QRegion &region, Node *origin)
 {
     // qDebug() << "Dirty" << region;
 
     if (m_painting)
         return;
-    paint(region);
+
+    // 光标的移动过于频繁，不做标记
+    if (m_damageDebug && origin && !region.isEmpty() && !qobject_cast<Cursor*>(origin)) {
+        if (m_damageMarks.size() >= MaxDamageMarks)
+            m_pendingDamage += m_damageMarks.takeFirst().area;
+
+        const QString name = origin->objectName().isEmpty()
+                                 ? QString::fromLatin1(origin->metaObject()->className())
+                                 : origin->objectName();
+        const QRect bounds = region.boundingRect();
+        QRegion area = region;
+        area += bounds;
+        area += damageMarkLabelRect(bounds, name);
+        m_damageMarks.append({ region, name, Output::monotonicTime(), area });
+    }
+
+    m_pendingDamage += region;
+    m_frameRequested = true;
+    scheduleFrame();
 }
 
 void Compositor::addWindow(Window *window)
@@ -315,6 +767,28 @@ void Compositor::removeWindow(Window *window)
     }
 }
 
+void Compositor::addCapture(Capture *capture)
+{
+    // 直接从合成结果中复制，扩展模式下由各个屏幕的缓冲区拼成整个桌面
+    QList<Capture::Source> sources;
+    if (m_outputLayout == OutputLayout::Extended) {
+        for (auto o : std::as_const(m_outputs)) {
+            const OutputView &view = m_outputViews[o];
+            sources.append({ &view.buffer, view.geometry });
+        }
+    } else {
+        sources.append({ &m_buffer, m_buffer.rect() });
+    }
+
+    capture->setSources(sources);
+    m_captures.append(capture);
+}
+
+void Compositor::removeCapture(Capture *capture)
+{
+    m_captures.removeOne(capture);
+}
+
 Node::Node(Node *parent)
     : QObject(parent)
 {
@@ -474,8 +948,21 @@ void Node::update(QRegion region, bool force)
     if (!qobject_cast<Cursor*>(this))
         qDebug() << this << "request update" << region;
 
-    if (auto parentNode = this->parentNode())
-        parentNode->update(region.translated(geometry().topLeft()));
+    propagateUpdate(region, this);
+}
+
+void Node::propagateUpdate(const QRegion &region, Node *origin)
+{
+    auto parentNode = this->parentNode();
+    if (parentNode && parentNode->isVisible())
+        parentNode->propagateUpdate(region.translated(geometry().topLeft()), origin);
+}
+
+// 子节点的移动、层级变化等由父节点代为更新，但记在子节点名下
+void Node::updateFrom(Node *origin, const QRegion &region)
+{
+    if (isVisible())
+        propagateUpdate(region, origin);
 }
 
 bool Node::event(QEvent *event)
@@ -508,16 +995,16 @@ void Node::addChild(Node *child)
         QPoint positionDiff = oldGeo.topLeft() - newGeo.topLeft();
         QRegion dirtyRegion = child->wholeGeometry();
         dirtyRegion += dirtyRegion.translated(positionDiff);
-        update(dirtyRegion);
+        updateFrom(child, dirtyRegion);
     });
 
     connect(child, &Node::zChanged, this, [this, child] {
         sortChild(child);
-        update(child->wholeGeometry());
+        updateFrom(child, child->wholeGeometry());
     });
 
     if (child->isVisible())
-        update(child->wholeGeometry());
+        updateFrom(child, child->wholeGeometry());
 }
 
 void Node::removeChild(Node *child)
@@ -528,7 +1015,7 @@ void Node::removeChild(Node *child)
     child->m_parent = nullptr;
     m_orderedChildren.removeOne(child);
     if (child->isVisible())
-        update(child->wholeGeometry());
+        updateFrom(child, child->wholeGeometry());
 }
 
 bool Node::sortChild(Node *child)
@@ -580,12 +1067,19 @@ Window::Window(Node *parent)
 {
     setVisible(false);
     connect(this, &Window::geometryChanged, this, &Window::onGeometryChanged);
+    connect(this, &Window::visibleChanged, this, &Window::onVisibleChanged);
     connect(m_titlebar, &WindowTitleBar::requestClose, this, [this] {
         setVisible(false);
     });
     onGeometryChanged();
 }
 
+Window::~Window()
+{
+    for (const auto &buffer : m_sharedBuffers.values())
+        m_shmPool->free(buffer.offset);
+}
+
 Window::State Window::state() const
 {
     return m_state;
@@ -603,6 +1097,12 @@ void Window::setState(State newState)
 // for render
 bool Window::begin()
 {
+    // 隐藏的窗口不保留内容，显示时再请求重绘
+    if (!isVisible()) {
+        m_contentLost = true;
+        return false;
+    }
+
     if (m_bgBuffer.isNull())
         return false;
 
@@ -610,10 +1110,22 @@ bool Window::begin()
         return true;
 
     Q_ASSERT(m_damage.isEmpty());
+    if (m_damage.bounds() != rect())
+        m_damage.setBounds(rect());
+
+    // end() 按 tile 整块复制，m_buffer 经其它途径更新过时需要先同步
+    if (m_bgBufferStale) {
+        detachBuffer();
+        m_bgBuffer = m_buffer;
+        m_bgBufferStale = false;
+    }
+
     bool ok = m_painter.begin(&m_bgBuffer);
 
-    if (ok)
+    if (ok) {
+        m_showingDisplayList = false;
         qDebug() << "Paint request from client" << this;
+    }
 
     return ok;
 }
@@ -624,7 +1136,7 @@ void Window::fillRect(QRect rect, QColor color)
         return;
 
     m_damage += rect;
-    m_painter.fillRect(rect, color);
+    SolidFill::fillRect(&m_painter, rect, color);
 }
 
 void Window::drawText(QPoint pos, QString text, QColor color)
@@ -632,12 +1144,20 @@ void Window::drawText(QPoint pos, QString text, QColor color)
     if (!m_painter.isActive())
         return;
 
-    QRect textRect = m_painter.boundingRect(pos.x(), pos.y(),
-                                            rect().width() - pos.x(),
-                                            rect().height() - pos.y(),
-                                            0, text);
+    // 重复绘制的单行文本只需混合缓存的字形
+    const bool singleLine = TextCache::isSingleLine(text);
+    auto cache = TextCache::instance();
+    const QRect textRect = singleLine
+        ? cache->boundingRect(m_painter.font(), pos, text)
+        : m_painter.boundingRect(pos.x(), pos.y(),
+                                 rect().width() - pos.x(),
+                                 rect().height() - pos.y(),
+                                 0, text);
 
     m_damage += textRect;
+    if (singleLine && cache->drawText(&m_painter, pos, text, color, rect()))
+        return;
+
     m_painter.setBrush(Qt::NoBrush);
     m_painter.setPen(color);
     m_painter.drawText(textRect, text);
@@ -650,90 +1170,396 @@ void Window::end()
 
     m_painter.end();
 
-    if (m_damage.isEmpty())
+    // 没有任何变化也需要一帧，等待 frameDone 的客户端才不会停住
+    if (m_damage.isEmpty()) {
+        markFramePending();
+        update(QRegion());
         return;
+    }
+
+    detachBuffer();
+
+    // 按 tile 合并后的矩形数量有上限，不受客户端绘制碎片化的影响
+    const QRegion tmp = m_damage.region();
+    m_damage.clear();
+    m_tileHashes.clear();
 
     m_painter.begin(&m_buffer);
-    for (QRect r : m_damage) {
+    for (const QRect &r : tmp) {
         m_painter.drawImage(r, m_bgBuffer, r);
     }
-
-    QRegion tmp;
-    m_damage.swap(tmp);
+    m_painter.end();
 
     qDebug() << "Damage by client" << tmp;
 
+    markFramePending();
     update(tmp);
 }
 
-QPair<QString, QSize> Window::getShm()
+bool Window::submit(const QByteArray &commands)
 {
-    QSharedMemory *shm = nullptr;
-    if (m_shmList.isEmpty() || m_shmList.last()->property("_image_size").toSize() != m_buffer.size()) {
-        shm = new QSharedMemory(this);
-        QNativeIpcKey key(QString::number(reinterpret_cast<quintptr>(shm), 16));
-        shm->setNativeKey(key);
-        qDebug() << "Create shared memory with key:" << key.toString();
+    // 先完整校验，不合法的命令一条也不执行
+    DrawCommandsValidator validator;
+    if (!DrawCommands::forEach(commands, validator)) {
+        qWarning() << "Invalid draw commands from client" << this;
+        return false;
+    }
 
-        if (!shm->create(m_buffer.sizeInBytes())) {
-            qWarning() << "Can't create shared memory:" << shm->errorString();
-            shm->deleteLater();
-            return {};
-        }
+    if (!begin())
+        return false;
+
+    DrawCommands::forEach(commands, *this);
+    end();
+    return true;
+}
 
-        shm->setProperty("_image_size", m_buffer.size());
-        m_shmList.append(shm);
+bool Window::setDisplayList(const QByteArray &commands)
+{
+    DrawCommandsValidator validator;
+    if (!DrawCommands::forEach(commands, validator)) {
+        qWarning() << "Invalid display list from client" << this;
+        return false;
+    }
+
+    const QByteArray oldList = std::exchange(m_displayList, commands);
+    if (m_displayList.isEmpty()) {
+        m_showingDisplayList = false;
+        return true;
     }
 
-    return {m_shmList.last()->nativeKey(), m_buffer.size()};
+    // 窗口的内容仍是旧 display list 的回放结果时，只重绘两者不同的部分
+    const QRegion damage = m_showingDisplayList ? displayListDamage(oldList, rect(), m_displayList, rect())
+                                                : QRegion(rect());
+    paintDisplayList(damage);
+    m_showingDisplayList = !m_buffer.isNull();
+    markFramePending();
+    update(damage);
+    return true;
+}
+
+void Window::paintDisplayList(const QRegion &region)
+{
+    if (m_displayList.isEmpty() || m_buffer.isNull() || region.isEmpty())
+        return;
+
+    // display list 的内容会覆盖挂载的客户端缓冲区
+    detachBuffer();
+
+    m_bgBufferStale = true;
+    m_tileHashes.clear();
+
+    // 与在空白的缓冲区上回放一致，没有命令覆盖的地方为黑色
+    QPainter pa(&m_buffer);
+    pa.setClipRegion(region);
+    pa.fillRect(rect(), Qt::black);
+    DisplayListPainter painter(&pa, region, rect());
+    DrawCommands::forEach(m_displayList, painter);
+}
+
+void Window::setShmPool(const std::shared_ptr<ShmPool> &pool)
+{
+    Q_ASSERT(m_sharedBuffers.isEmpty());
+    m_shmPool = pool;
+}
+
+Window::SharedBuffer Window::getShm()
+{
+    // 不依赖 m_buffer，隐藏的窗口也可以申请
+    const QSize size = geometry().size();
+    if (!m_shmPool || size.isEmpty())
+        return {};
+
+    // 每次调用都分配新的缓冲区，客户端可以借此实现多缓冲，但不超过三缓冲
+    if (m_sharedBuffers.count() >= MaxSharedBuffers) {
+        qWarning() << "Too many shared buffers for" << this;
+        return {};
+    }
+
+    SharedBuffer buffer;
+    buffer.size = size;
+    // 与 QImage 一样按 4 字节对齐
+    buffer.bytesPerLine = ((size.width() * QImage::toPixelFormat(BufferFormat).bitsPerPixel() + 31) >> 5) << 2;
+    buffer.offset = m_shmPool->allocate(Shm::HeaderSize + qint64(buffer.bytesPerLine) * size.height());
+    if (buffer.offset < 0) {
+        qWarning() << "Can't allocate shared buffer for" << this;
+        return {};
+    }
+
+    buffer.id = m_sharedBuffers.insert(buffer);
+    if (!buffer.id) {
+        m_shmPool->free(buffer.offset);
+        return {};
+    }
+    m_sharedBuffers.pointer(buffer.id)->id = buffer.id;
+
+    qDebug() << "Create shared buffer" << buffer.id << "at offset:" << buffer.offset;
+    Shm::releaseBuffer(Shm::bufferHeader(m_shmPool->data(), buffer.offset));
+
+    return buffer;
 }
 
-void Window::releaseShm(const QString &nativeKey)
+void Window::releaseShm(quint32 id)
 {
-    if (auto shm = getShm(nativeKey)) {
-        shm->deleteLater();
-        m_shmList.removeOne(shm);
+    if (id == m_attachedBuffer)
+        detachBuffer();
+
+    if (auto buffer = m_sharedBuffers.pointer(id)) {
+        m_shmPool->free(buffer->offset);
+        m_sharedBuffers.remove(id);
     }
 }
 
-bool Window::putImage(const QString &nativeKey, QRegion region)
+bool Window::putImage(quint32 id, QRegion region)
 {
-    auto shm = getShm(nativeKey);
-    if (!shm)
+    auto buffer = getShm(id);
+    if (!buffer)
         return false;
 
-    if (!shm->lock())
+    // 客户端未提交的缓冲区可能正在被写入，直接拒绝而不是等待
+    auto header = Shm::bufferHeader(m_shmPool->data(), buffer->offset);
+    if (!Shm::isCompositorOwned(header)) {
+        qWarning() << "Buffer" << id << "is not committed by client" << this;
         return false;
+    }
 
+    if (!isVisible()) {
+        dropHiddenUpdate(buffer);
+        return true;
+    }
+
+    // 只拷贝客户端声明的区域，缓冲区中其余部分的内容是不确定的。按 tile 对齐
+    // 的只是交给合成器的损坏区域
     if (region.isEmpty())
         region += rect();
+    region &= rect();
+    QRegion damage = TileDamage::simplified(region, rect());
+
+    QImage tmpImage(Shm::bufferData(m_shmPool->data(), buffer->offset),
+                    buffer->size.width(), buffer->size.height(),
+                    buffer->bytesPerLine, BufferFormat);
+
+    // 拷贝只会更新部分区域，其余内容需要先从挂载的缓冲区中取回
+    QRegion copyRegion = region;
+    if (m_attachedBuffer == id) {
+        copyRegion = rect();
+        m_attachedBuffer = 0;
+        m_attachedImage = QImage();
+    } else {
+        detachBuffer();
 
-    const QSize size = shm->property("_image_size").toSize();
-    QImage tmpImage(reinterpret_cast<uchar*>(shm->data()), size.width(), size.height(), m_buffer.format());
+        // m_buffer 就是当前的内容，与之逐行比较，没有变化的 tile 既不拷贝也不
+        // 重新合成
+        if (buffer->size == m_buffer.size()) {
+            damage = differingTiles(tmpImage, region);
+            copyRegion = region & damage;
+        }
+    }
 
     m_painter.begin(&m_buffer);
-    for (QRect r : region) {
+    for (QRect r : copyRegion) {
         m_painter.drawImage(r, tmpImage, r);
     }
     m_painter.end();
+    m_showingDisplayList = false;
+    m_tileHashes.clear();
+    m_bgBufferStale = true;
 
-    shm->unlock();
+    Shm::releaseBuffer(header);
+    emit bufferReleased(id);
+
+    markFramePending();
+    update(damage);
+    return true;
+}
+
+bool Window::commit(quint32 id, QRegion region)
+{
+    auto buffer = getShm(id);
+    if (!buffer)
+        return false;
+
+    // 尺寸不一致时（例如正在调整大小）退回到拷贝的方式
+    if (buffer->size != m_buffer.size())
+        return putImage(id, region);
+
+    auto header = Shm::bufferHeader(m_shmPool->data(), buffer->offset);
+    if (!Shm::isCompositorOwned(header)) {
+        qWarning() << "Buffer" << id << "is not committed by client" << this;
+        return false;
+    }
 
+    if (!isVisible()) {
+        dropHiddenUpdate(buffer);
+        return true;
+    }
+
+    // 之前挂载的缓冲区已经不再需要，归还给客户端
+    if (m_attachedBuffer && m_attachedBuffer != id) {
+        if (auto old = getShm(m_attachedBuffer)) {
+            Shm::releaseBuffer(Shm::bufferHeader(m_shmPool->data(), old->offset));
+            emit bufferReleased(m_attachedBuffer);
+        }
+    }
+
+    // 直接使用客户端的缓冲区作为窗口内容，合成时从中采样，省去一次拷贝
+    m_attachedBuffer = id;
+    m_bgBufferStale = true;
+    m_showingDisplayList = false;
+    m_attachedImage = QImage(Shm::bufferData(m_shmPool->data(), buffer->offset),
+                             buffer->size.width(), buffer->size.height(),
+                             buffer->bytesPerLine, BufferFormat);
+
+    if (region.isEmpty())
+        region += rect();
+    // 内容没有变化的 tile 不必重新合成
+    region = changedTiles(m_attachedImage, TileDamage::simplified(region, rect()));
+
+    markFramePending();
     update(region);
     return true;
 }
 
+void Window::framePresented(qint64 timestamp, qint64 refreshInterval)
+{
+    if (!m_pendingSerial)
+        return;
+
+    // 在提交后的第一个 vblank 中显示即为准时
+    const bool onTime = timestamp - m_pendingCommitTime <= refreshInterval;
+    emit presented(m_pendingSerial, timestamp, refreshInterval, onTime);
+    m_pendingSerial = 0;
+
+    emit frameDone();
+}
+
+// 返回 region 中内容与上次提交不同的 tile，并记下这些 tile 新的哈希。只用于
+// commit，putImage 有 m_buffer 可以直接比较。region 应当已经按 tile 对齐，image
+// 与窗口一样大
+QRegion Window::changedTiles(const QImage &image, const QRegion &region)
+{
+    constexpr int TileSize = TileDamage::TileSize;
+    const int columns = (rect().width() + TileSize - 1) / TileSize;
+    const int rows = (rect().height() + TileSize - 1) / TileSize;
+    if (m_tileHashes.size() != rows * columns)
+        m_tileHashes.fill(0, rows * columns);
+
+    const int bpp = image.depth() / 8;
+    TileDamage changed(rect());
+
+    for (const QRect &r : region) {
+        for (int row = r.top() / TileSize; row <= r.bottom() / TileSize; ++row) {
+            for (int column = r.left() / TileSize; column <= r.right() / TileSize; ++column) {
+                const QRect tile = QRect(column * TileSize, row * TileSize, TileSize, TileSize) & rect();
+
+                // 使用进程随机的种子，客户端无法构造出碰撞
+                size_t hash = QHashSeed::globalSeed();
+                for (int y = tile.top(); y <= tile.bottom(); ++y)
+                    hash = qHashBits(image.constScanLine(y) + tile.left() * bpp, tile.width() * bpp, hash);
+                // 0 留给未知的 tile
+                hash = hash ? hash : 1;
+
+                size_t &old = m_tileHashes[row * columns + column];
+                if (old != hash) {
+                    old = hash;
+                    changed += tile;
+                }
+            }
+        }
+    }
+
+    return changed.region();
+}
+
+// 隐藏的窗口不参与合成，缓冲区立即归还，内容留到显示时请求客户端重绘
+void Window::dropHiddenUpdate(const SharedBuffer *buffer)
+{
+    m_contentLost = true;
+    Shm::releaseBuffer(Shm::bufferHeader(m_shmPool->data(), buffer->offset));
+    emit bufferReleased(buffer->id);
+    // 不会有送显，直接通知客户端可以继续
+    emit frameDone();
+}
+
+// 返回 region 中内容与 m_buffer 不同的部分所在的 tile，image 与窗口一样大
+QRegion Window::differingTiles(const QImage &image, const QRegion &region) const
+{
+    constexpr int TileSize = TileDamage::TileSize;
+    const int bpp = image.depth() / 8;
+    TileDamage changed(rect());
+
+    for (const QRect &r : region) {
+        for (int row = r.top() / TileSize; row <= r.bottom() / TileSize; ++row) {
+            for (int column = r.left() / TileSize; column <= r.right() / TileSize; ++column) {
+                const QRect part = QRect(column * TileSize, row * TileSize, TileSize, TileSize) & r;
+
+                for (int y = part.top(); y <= part.bottom(); ++y) {
+                    if (memcmp(image.constScanLine(y) + part.left() * bpp,
+                               m_buffer.constScanLine(y) + part.left() * bpp,
+                               part.width() * bpp) != 0) {
+                        changed += part;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    return changed.region();
+}
+
+void Window::markFramePending()
+{
+    m_pendingSerial = ++m_commitSerial;
+    m_pendingCommitTime = Output::monotonicTime();
+}
+
+void Window::detachBuffer()
+{
+    if (!m_attachedBuffer)
+        return;
+
+    if (m_attachedImage.size() == m_buffer.size()) {
+        m_painter.begin(&m_buffer);
+        m_painter.setCompositionMode(QPainter::CompositionMode_Source);
+        m_painter.drawImage(0, 0, m_attachedImage);
+        m_painter.end();
+    }
+
+    if (auto buffer = getShm(m_attachedBuffer)) {
+        Shm::releaseBuffer(Shm::bufferHeader(m_shmPool->data(), buffer->offset));
+        emit bufferReleased(m_attachedBuffer);
+    }
+
+    m_attachedBuffer = 0;
+    m_attachedImage = QImage();
+}
+
 void Window::paint(QPainter *pa)
 {
-    pa->drawImage(rect(), m_buffer);
+    pa->drawImage(rect(), m_attachedBuffer ? m_attachedImage : m_buffer);
 }
 
 bool Window::event(QEvent *event)
 {
     switch (event->type()) {
-    case QEvent::MouseButtonPress: Q_FALLTHROUGH();
-    case QEvent::MouseButtonRelease: Q_FALLTHROUGH();
     case QEvent::MouseMove: {
+        auto ev = static_cast<QMouseEvent*>(event);
+        const Motion motion { ev->position().toPoint(), ev->globalPosition().toPoint(),
+                              ev->buttons(), ev->modifiers() };
+        if (!m_motionHistory && !m_pendingMotion.isEmpty())
+            m_pendingMotion.last() = motion;
+        else
+            m_pendingMotion.append(motion);
+
+        // 由合成器在下一帧开始时发出，没有其它更新时也需要这一帧
+        if (m_pendingMotion.size() == 1)
+            update(QRegion());
+        break;
+    }
+    // 按钮、按键事件不合并，并且需要保证与之前的移动事件的顺序
+    case QEvent::MouseButtonPress: Q_FALLTHROUGH();
+    case QEvent::MouseButtonRelease: {
+        flushMotion();
         auto ev = static_cast<QMouseEvent*>(event);
         emit mouseEvent(event->type(), ev->position().toPoint(), ev->globalPosition().toPoint(),
                         ev->button(), ev->buttons(), ev->modifiers());
@@ -741,21 +1567,38 @@ bool Window::event(QEvent *event)
     }
     case QEvent::KeyPress: Q_FALLTHROUGH();
     case QEvent::KeyRelease: {
+        flushMotion();
         auto ev = static_cast<QKeyEvent*>(event);
         emit keyEvent(ev->type(), ev->key(), ev->modifiers(), ev->text());
         break;
     }
     case QEvent::Wheel: {
+        flushMotion();
         auto ev = static_cast<QWheelEvent*>(event);
         emit wheelEvent(ev->position().toPoint(), ev->globalPosition().toPoint(),
                         ev->angleDelta(), ev->buttons(), ev->modifiers());
         break;
     }
+    default: break;
     }
 
     return Node::event(event);
 }
 
+void Window::setMotionHistory(bool enabled)
+{
+    m_motionHistory = enabled;
+}
+
+void Window::flushMotion()
+{
+    const auto motions = std::exchange(m_pendingMotion, {});
+    for (const auto &motion : motions) {
+        emit mouseEvent(QEvent::MouseMove, motion.local, motion.global,
+                        Qt::NoButton, motion.buttons, motion.modifiers);
+    }
+}
+
 void Window::onGeometryChanged()
 {
     updateTitleBarGeometry();
@@ -775,25 +1618,92 @@ void Window::updateTitleBarGeometry()
 
 void Window::updateBuffers()
 {
+    // 只是移动了位置，内容不受影响
     const QSize size = geometry().size();
-    if (size.isEmpty()) {
-        m_buffer = QImage();
-        m_bgBuffer = m_buffer;
+    if (isVisible() && !m_buffer.isNull() && m_buffer.size() == size)
+        return;
+
+    // 尺寸变化前 display list 的回放结果，其中不受尺寸影响的部分可以保留
+    const QImage oldBuffer = m_showingDisplayList ? m_buffer : QImage();
+    m_showingDisplayList = false;
+
+    // 挂载的缓冲区尺寸已经不匹配，内容也会被丢弃
+    if (m_attachedBuffer) {
+        m_attachedImage = QImage();
+        detachBuffer();
+    }
+
+    m_tileHashes.clear();
+
+    // 隐藏的窗口不持有像素缓冲区，显示时再分配
+    if (size.isEmpty() || !isVisible()) {
+        releaseBuffers();
         return;
     }
 
-    m_buffer = QImage(size, QImage::Format_RGB888);
+    m_buffer = QImage(size, BufferFormat);
     m_buffer.fill(Qt::black);
+
+    // 无需客户端参与，直接回放 display list 得到新尺寸下的内容。只有受尺寸
+    // 影响的命令和新增的区域需要回放，其余部分从旧的缓冲区复制
+    QRegion region = rect();
+    if (!oldBuffer.isNull()) {
+        region = displayListDamage(m_displayList, oldBuffer.rect(), m_displayList, rect())
+                 + (QRegion(rect()) - oldBuffer.rect());
+
+        const int bpp = m_buffer.depth() / 8;
+        for (const QRect &r : QRegion(rect() & oldBuffer.rect()) - region) {
+            for (int y = r.top(); y <= r.bottom(); ++y) {
+                memcpy(m_buffer.scanLine(y) + r.left() * bpp,
+                       oldBuffer.constScanLine(y) + r.left() * bpp,
+                       r.width() * bpp);
+            }
+        }
+    }
     m_bgBuffer = m_buffer;
+
+    paintDisplayList(region);
+    m_showingDisplayList = !m_displayList.isEmpty();
 }
 
-QSharedMemory *Window::getShm(const QString &nativeKey) const
+void Window::releaseBuffers()
 {
-    for (auto shm : m_shmList)
-        if (shm->nativeKey() == nativeKey)
-            return shm;
+    if (m_painter.isActive())
+        m_painter.end();
+    m_damage = TileDamage();
+
+    // 挂载的缓冲区直接归还给客户端，内容不再取回
+    if (m_attachedBuffer) {
+        m_attachedImage = QImage();
+        detachBuffer();
+        m_contentLost = true;
+    }
 
-    return nullptr;
+    if (!m_buffer.isNull())
+        m_contentLost = true;
+    m_buffer = QImage();
+    m_bgBuffer = QImage();
+    m_bgBufferStale = false;
+    m_showingDisplayList = false;
+    m_tileHashes = {};
+}
+
+void Window::onVisibleChanged(bool visible)
+{
+    if (!visible) {
+        releaseBuffers();
+        return;
+    }
+
+    // 重新分配缓冲区并回放 display list，没有 display list 时只能由客户端重绘
+    updateBuffers();
+    if (std::exchange(m_contentLost, false) && m_displayList.isEmpty())
+        emit repaintRequested();
+}
+
+const Window::SharedBuffer *Window::getShm(quint32 id) const
+{
+    return m_sharedBuffers.pointer(id);
 }
 
 Rectangle::Rectangle(Node *parent)
@@ -818,7 +1728,7 @@ void Rectangle::setColor(const QColor &newColor)
 
 void Rectangle::paint(QPainter *pa)
 {
-    pa->fillRect(rect(), m_color);
+    SolidFill::fillRect(pa, rect(), m_color);
 }
 
 WindowTitleBar::WindowTitleBar(Window *window)
@@ -854,7 +1764,7 @@ void WindowTitleBar::updateButtonGeometry()
 
 void WindowTitleBar::paint(QPainter *pa)
 {
-    pa->fillRect(rect(), Qt::white);
+    SolidFill::fillRect(pa, rect(), Qt::white);
 }
 
 Cursor::Cursor(Node *parent)
@@ -9,8 +9,14 @@
 #include <QImage>
 #include <QPointer>
 #include <QPainter>
-#include <QSharedMemory>
 #include <QEvent>
+#include <QBasicTimer>
+#include <QHash>
+
+#include <memory>
+
+#include "handletable.h"
+#include "tiledamage.h"
 
 QT_BEGIN_NAMESPACE
 class QFbVtHandler;
@@ -59,6 +65,9 @@ signals:
 protected:
     virtual void paint(QPainter *pa);
     virtual void update(QRegion region, bool force = false);
+    // 把 origin 发起的更新逐级交给父节点，region 为本节点的坐标
+    virtual void propagateUpdate(const QRegion &region, Node *origin);
+    void updateFrom(Node *origin, const QRegion &region);
     bool event(QEvent *event) override;
 
     void addChild(Node *child);
@@ -73,9 +82,11 @@ private:
     int m_z = 0;
 };
 
+class ShmPool;
 class WindowTitleBar;
 class Window : public Node
 {
+    friend class Compositor;
     Q_OBJECT
     Q_PROPERTY(State state READ state WRITE setState NOTIFY stateChanged FINAL)
 
@@ -86,7 +97,20 @@ public:
     };
     Q_ENUM(State)
 
+    struct SharedBuffer {
+        quint32 id = 0;
+        qint64 offset = -1;
+        QSize size;
+        int bytesPerLine = 0;
+    };
+
+    static constexpr QImage::Format BufferFormat = QImage::Format_RGB888;
+    // 每个窗口最多同时持有的共享缓冲区数
+    static constexpr int MaxSharedBuffers = 3;
+
     explicit Window(Node *parent = nullptr);
+    ~Window();
+
     Window::State state() const;
     void setState(State newState);
 
@@ -95,11 +119,24 @@ public:
     void fillRect(QRect rect, QColor color);
     void drawText(QPoint pos, QString text, QColor color);
     void end();
+    bool submit(const QByteArray &commands);
+    // 保留在合成器中的绘制命令，调整大小等需要重绘时由合成器自行回放
+    bool setDisplayList(const QByteArray &commands);
 
     // for shm
-    QPair<QString, QSize> getShm();
-    void releaseShm(const QString &nativeKey);
-    bool putImage(const QString &nativeKey, QRegion region);
+    void setShmPool(const std::shared_ptr<ShmPool> &pool);
+    SharedBuffer getShm();
+    void releaseShm(quint32 id);
+    bool putImage(quint32 id, QRegion region);
+    bool commit(quint32 id, QRegion region);
+
+    // 包含本窗口更新的一帧送显完成后由合成器调用，timestamp 为该帧所在
+    // vblank 的 CLOCK_MONOTONIC 时间，单位均为纳秒
+    void framePresented(qint64 timestamp, qint64 refreshInterval);
+
+    // 指针移动事件按帧合并后再发给客户端，默认只保留最新的位置，开启后会在
+    // 帧边界依次发出期间所有的位置
+    void setMotionHistory(bool enabled);
 
 signals:
     void stateChanged();
@@ -110,6 +147,12 @@ signals:
                     Qt::MouseButtons button, Qt::KeyboardModifiers modifiers);
     void keyEvent(QEvent::Type type, int qtkey, Qt::KeyboardModifiers modifiers,
                   QString text);
+    void bufferReleased(quint32 id);
+    void frameDone();
+    // serial 为该窗口成功提交的次数，同一帧中被后续提交覆盖的更新不会上报
+    void presented(quint32 serial, qint64 timestamp, qint64 refreshInterval, bool onTime);
+    // 隐藏期间丢弃的内容无法由 display list 恢复，显示时请求客户端重绘
+    void repaintRequested();
 
 private:
     void paint(QPainter *pa) override;
@@ -117,15 +160,53 @@ private:
     void onGeometryChanged();
     void updateTitleBarGeometry();
     void updateBuffers();
-    QSharedMemory *getShm(const QString &nativeKey) const;
+    void releaseBuffers();
+    void onVisibleChanged(bool visible);
+    void dropHiddenUpdate(const SharedBuffer *buffer);
+    const SharedBuffer *getShm(quint32 id) const;
+    void detachBuffer();
+    void markFramePending();
+    void paintDisplayList(const QRegion &region);
+    void flushMotion();
+    QRegion changedTiles(const QImage &image, const QRegion &region);
+    QRegion differingTiles(const QImage &image, const QRegion &region) const;
+
+    struct Motion {
+        QPoint local;
+        QPoint global;
+        Qt::MouseButtons buttons;
+        Qt::KeyboardModifiers modifiers;
+    };
 
+    // 只在窗口可见时分配，隐藏后释放
     QImage m_buffer;
     // for render
     QImage m_bgBuffer;
-    QRegion m_damage;
+    // m_buffer 被 putImage、commit 或 display list 更新后，m_bgBuffer 已不是最新内容
+    bool m_bgBufferStale = false;
+    TileDamage m_damage;
+    // 最近一次 commit 的各个 tile 内容的哈希，0 表示未知，只用于没有保留内容的
+    // 零拷贝提交。m_buffer 经其它途径修改后全部作废
+    QList<size_t> m_tileHashes;
     QPainter m_painter;
+    QByteArray m_displayList;
+    // m_buffer 的内容完全是 m_displayList 回放的结果，没有被客户端的其它绘制覆盖
+    bool m_showingDisplayList = false;
     // for shm
-    QList<QSharedMemory*> m_shmList;
+    std::shared_ptr<ShmPool> m_shmPool;
+    HandleTable<SharedBuffer> m_sharedBuffers;
+    // 通过 commit 挂载、直接作为窗口内容的客户端缓冲区
+    quint32 m_attachedBuffer = 0;
+    QImage m_attachedImage;
+    // 隐藏时丢弃了窗口内容
+    bool m_contentLost = false;
+    // 客户端提交了新内容，等待送显
+    quint32 m_commitSerial = 0;
+    quint32 m_pendingSerial = 0;
+    qint64 m_pendingCommitTime = 0;
+    // 等待在下一帧发出的指针移动事件
+    QList<Motion> m_pendingMotion;
+    bool m_motionHistory = false;
 
     State m_state;
     WindowTitleBar *m_titlebar;
@@ -195,6 +276,8 @@ private:
 
 class Input;
 class Output;
+class Scanout;
+class Capture;
 class VirtualOutput;
 class Compositor : public QObject
 {
@@ -213,22 +296,91 @@ public:
 
     void setWallpaper(const QImage &image);
 
-    void markDirty(const QRegion &region);
+    // origin 为发起更新的节点，仅用于调试
+    void markDirty(const QRegion &region, Node *origin = nullptr);
+
+    bool isDamageDebug() const;
+    // 开启后每帧更新的区域以渐隐的颜色标出，并注明发起更新的节点
+    void setDamageDebug(bool enabled);
 
     void addWindow(Window *window);
     void removeWindow(Window *window);
 
+    void addCapture(Capture *capture);
+    void removeCapture(Capture *capture);
+
 signals:
     void backgroundChanged();
 
 private:
+    // 预计合成完成后距离 vblank 至少留出的时间，单位纳秒
+    static constexpr qint64 FrameMargin = 2000000;
+    // 损坏区域标记渐隐的时长，单位纳秒
+    static constexpr qint64 DamageMarkDuration = 1000000000;
+    static constexpr int MaxDamageMarks = 256;
+
+    enum class OutputLayout {
+        // 所有屏幕显示同样的内容，按主屏的大小合成后缩放到其它屏幕
+        Mirrored,
+        // 每个屏幕显示桌面中的一块区域，各自合成
+        Extended
+    };
+
+    // 扩展模式下一个屏幕在桌面中的区域和它自己的合成缓冲区
+    struct OutputView {
+        QRect geometry;
+        QImage buffer;
+        QImage wallpaper;
+    };
+
+    bool composite(QImage *buffer, const QRect &geometry, const QRegion &region, QImage *wallpaper);
+    void paintDamageMarks(QPainter *pa);
+    void updateDamageMarks();
     void paint(const QRegion &region);
     void paint();
+    void scheduleFrame();
+    void onScanoutFinished();
+    void framePresented();
+    // 显示在 rect 处的窗口这一帧的送显时间和所在屏幕的刷新间隔，没有合适的屏幕时不修改
+    void presentTiming(const QRect &rect, qint64 now, qint64 *time, qint64 *interval) const;
+    // 镜像模式下所有屏幕都显示整个桌面
+    bool isShownOn(Output *output, const QRect &rect) const;
     void setFocusWindow(Window *window);
+    void timerEvent(QTimerEvent *event) override;
 
     QFbVtHandler *m_vtHandler = nullptr;
     Input *m_input = nullptr;
     QList<Output*> m_outputs;
+    // 每个屏幕的送显线程，与 m_outputs 对应
+    QList<Scanout*> m_scanouts;
+    // 正在送显的屏幕数，为 0 之前不开始下一帧
+    int m_pendingScanouts = 0;
+    // 最近一帧实际送显了的屏幕
+    QList<Output*> m_scannedOutputs;
+    // 下一帧需要重绘的区域
+    TileDamage m_pendingDamage;
+    // 没有需要重绘的区域也要产生一帧，以便通知窗口提交已经处理
+    bool m_frameRequested = false;
+    QBasicTimer m_frameTimer;
+    // 最近几帧合成的平均耗时，单位纳秒
+    qint64 m_compositeCost = 0;
+
+    struct DamageMark {
+        QRegion region;
+        QString origin;
+        qint64 time;
+        // 包括边框和名称在内实际绘制到的区域，清除时要全部重绘
+        QRegion area;
+    };
+    bool m_damageDebug = false;
+    QList<DamageMark> m_damageMarks;
+
+    // 录屏的订阅者，为空时合成的过程中没有任何额外的开销
+    QList<Capture*> m_captures;
+    OutputLayout m_outputLayout = OutputLayout::Mirrored;
+    QHash<Output*, OutputView> m_outputViews;
+    // 所有屏幕组成的桌面，镜像模式下与 m_buffer 一样大
+    QRect m_desktopRect;
     // for debug
     std::unique_ptr<VirtualOutput> m_virtualOutput;
 
@@ -247,8 +399,8 @@ private:
             return static_cast<Compositor*>(Node::parent());
         }
 
-        void update(QRegion region, bool) override {
-            parent()->markDirty(region);
+        void propagateUpdate(const QRegion &region, Node *origin) override {
+            parent()->markDirty(region, origin);
         }
     };
 
@@ -0,0 +1,142 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#include "connection.h"
+
+#include <QSocketNotifier>
+#include <QDebug>
+
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// 超过后认为客户端已经失去响应，断开连接让其退回到 QtRO
+static constexpr int MaxPendingMessages = 4096;
+
+Connection::Connection(int socket, QObject *parent)
+    : QObject(parent)
+    , m_socket(socket)
+    , m_readNotifier(new QSocketNotifier(socket, QSocketNotifier::Read, this))
+    , m_writeNotifier(new QSocketNotifier(socket, QSocketNotifier::Write, this))
+{
+    m_writeNotifier->setEnabled(false);
+    connect(m_readNotifier, &QSocketNotifier::activated, this, &Connection::onReadyRead);
+    connect(m_writeNotifier, &QSocketNotifier::activated, this, &Connection::onReadyWrite);
+}
+
+Connection::~Connection()
+{
+    if (m_socket >= 0)
+        ::close(m_socket);
+}
+
+bool Connection::isValid() const
+{
+    return m_socket >= 0;
+}
+
+pid_t Connection::peerPid() const
+{
+    ucred cred;
+    socklen_t length = sizeof(cred);
+    if (m_socket < 0 || getsockopt(m_socket, SOL_SOCKET, SO_PEERCRED, &cred, &length) < 0)
+        return -1;
+    return cred.pid;
+}
+
+void Connection::setHandler(Handler handler)
+{
+    m_handler = handler;
+}
+
+void Connection::send(const void *data, size_t size)
+{
+    if (m_socket < 0)
+        return;
+
+    if (m_pending.isEmpty()) {
+        if (::send(m_socket, data, size, MSG_DONTWAIT | MSG_NOSIGNAL) == ssize_t(size))
+            return;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            close();
+            return;
+        }
+    }
+
+    if (m_pending.size() >= MaxPendingMessages) {
+        qWarning() << "Too many pending fastpath messages, disconnect" << this;
+        close();
+        return;
+    }
+
+    m_pending.append(QByteArray(static_cast<const char*>(data), size));
+    m_writeNotifier->setEnabled(true);
+}
+
+bool Connection::sendFd(int fd, const void *data, size_t size)
+{
+    if (m_socket < 0)
+        return false;
+
+    return FastPath::sendFd(m_socket, fd, data, size);
+}
+
+void Connection::close()
+{
+    if (m_socket < 0)
+        return;
+
+    m_readNotifier->setEnabled(false);
+    m_writeNotifier->setEnabled(false);
+    ::close(m_socket);
+    m_socket = -1;
+    m_pending.clear();
+
+    emit closed();
+}
+
+void Connection::onReadyRead()
+{
+    alignas(8) char buffer[FastPath::MaxMessageSize];
+
+    while (m_socket >= 0) {
+        const ssize_t size = ::recv(m_socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size == 0) {
+            close();
+            return;
+        }
+
+        if (size < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                close();
+            return;
+        }
+
+        auto header = reinterpret_cast<const FastPath::Header*>(buffer);
+        if (size_t(size) < sizeof(FastPath::Header) || header->size != size) {
+            qWarning() << "Invalid fastpath message, size:" << size;
+            continue;
+        }
+
+        // 处理函数中可能会调用 setHandler，先复制一份再调用
+        if (const Handler handler = m_handler)
+            handler(header);
+    }
+}
+
+void Connection::onReadyWrite()
+{
+    while (!m_pending.isEmpty()) {
+        const QByteArray &data = m_pending.first();
+        if (::send(m_socket, data.constData(), data.size(), MSG_DONTWAIT | MSG_NOSIGNAL) != data.size()) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                close();
+            return;
+        }
+
+        m_pending.removeFirst();
+    }
+
+    m_writeNotifier->setEnabled(false);
+}
@@ -0,0 +1,56 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QObject>
+#include <QList>
+#include <QByteArray>
+
+#include <functional>
+#include <sys/types.h>
+
+#include "fastpath.h"
+
+QT_BEGIN_NAMESPACE
+class QSocketNotifier;
+QT_END_NAMESPACE
+
+// 与客户端之间的 fastpath 连接，收发消息都不会阻塞合成器
+class Connection : public QObject
+{
+    Q_OBJECT
+public:
+    using Handler = std::function<void(const FastPath::Header *message)>;
+
+    explicit Connection(int socket, QObject *parent = nullptr);
+    ~Connection();
+
+    bool isValid() const;
+    // 建立连接时对端进程的 pid，取不到时为 -1
+    pid_t peerPid() const;
+    void setHandler(Handler handler);
+
+    template<typename T>
+    void send(const T &message) {
+        send(&message, message.header.size);
+    }
+    void send(const void *data, size_t size);
+    bool sendFd(int fd, const void *data, size_t size);
+
+    void close();
+
+signals:
+    void closed();
+
+private:
+    void onReadyRead();
+    void onReadyWrite();
+
+    int m_socket;
+    QSocketNotifier *m_readNotifier;
+    QSocketNotifier *m_writeNotifier;
+    // 客户端来不及读取时暂存的消息
+    QList<QByteArray> m_pending;
+    Handler m_handler;
+};
@@ -0,0 +1,117 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QList>
+
+// 以整数 handle 索引对象，插入、删除和查找都是 O(1)。handle 的低位是槽的
+// 下标，高位是该槽的代数，槽被复用后旧的 handle 不会再匹配到新的对象。
+// 0 永远不是有效的 handle
+template<typename T>
+class HandleTable
+{
+public:
+    static constexpr int IndexBits = 20;
+    static constexpr quint32 IndexMask = (1u << IndexBits) - 1;
+    static constexpr quint32 MaxGeneration = (1u << (32 - IndexBits)) - 1;
+
+    // 槽已用尽时返回 0
+    quint32 insert(const T &value) {
+        quint32 index;
+        if (!m_freeSlots.isEmpty()) {
+            index = m_freeSlots.takeLast();
+        } else {
+            if (quint32(m_slots.size()) > IndexMask)
+                return 0;
+            index = m_slots.size();
+            m_slots.append(Slot());
+        }
+
+        Slot &slot = m_slots[index];
+        slot.value = value;
+        slot.used = true;
+        ++m_count;
+
+        return (slot.generation << IndexBits) | index;
+    }
+
+    bool remove(quint32 handle) {
+        Slot *slot = find(handle);
+        if (!slot)
+            return false;
+
+        slot->value = T();
+        slot->used = false;
+        slot->generation = slot->generation == MaxGeneration ? 1 : slot->generation + 1;
+        m_freeSlots.append(handle & IndexMask);
+        --m_count;
+
+        return true;
+    }
+
+    bool contains(quint32 handle) const {
+        return find(handle);
+    }
+
+    // handle 无效时返回默认构造的值
+    T value(quint32 handle) const {
+        const Slot *slot = find(handle);
+        return slot ? slot->value : T();
+    }
+
+    T *pointer(quint32 handle) {
+        Slot *slot = find(handle);
+        return slot ? &slot->value : nullptr;
+    }
+
+    const T *pointer(quint32 handle) const {
+        const Slot *slot = find(handle);
+        return slot ? &slot->value : nullptr;
+    }
+
+    int count() const {
+        return m_count;
+    }
+
+    bool isEmpty() const {
+        return m_count == 0;
+    }
+
+    QList<T> values() const {
+        QList<T> list;
+        list.reserve(m_count);
+        for (const Slot &slot : m_slots) {
+            if (slot.used)
+                list.append(slot.value);
+        }
+        return list;
+    }
+
+private:
+    struct Slot {
+        T value = T();
+        quint32 generation = 1;
+        bool used = false;
+    };
+
+    Slot *find(quint32 handle) {
+        return const_cast<Slot*>(std::as_const(*this).find(handle));
+    }
+
+    const Slot *find(quint32 handle) const {
+        const quint32 index = handle & IndexMask;
+        if (index >= quint32(m_slots.size()))
+            return nullptr;
+
+        const Slot &slot = m_slots.at(index);
+        if (!slot.used || slot.generation != handle >> IndexBits)
+            return nullptr;
+
+        return &slot;
+    }
+
+    QList<Slot> m_slots;
+    QList<quint32> m_freeSlots;
+    int m_count = 0;
+};
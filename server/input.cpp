@@ -2,17 +2,26 @@
 // SPDX-License-Identifier: MIT
 
 #include "input.h"
+#include "spscqueue.h"
 
 #include <QEvent>
 #include <QMouseEvent>
 #include <QKeyEvent>
 #include <QCoreApplication>
 #include <QSocketNotifier>
+#include <QThread>
+#include <QMutex>
+#include <QDebug>
 #include <private/qxkbcommon_p.h>
 
+#include <cerrno>
+#include <cstring>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <libinput.h>
+#include <xkbcommon/xkbcommon.h>
 
 static int liOpen(const char *path, int flags, void *user_data)
 {
@@ -45,10 +54,98 @@ static void liLogHandler(libinput *libinput, libinput_log_priority priority, con
     }
 }
 
+// 有积压的事件时输入线程重试的间隔，单位毫秒
+static constexpr int OverflowRetryInterval = 4;
+
+// 输入线程解码后交给主线程的事件
+struct InputEvent
+{
+    enum Kind : quint8 {
+        PointerDeviceChanged,
+        KeyboardDeviceChanged,
+        Mouse,
+        Wheel,
+        Key
+    };
+
+    Kind kind = Mouse;
+    QEvent::Type type = QEvent::None;
+    // 事件发生时的 libinput 时间，单位毫秒
+    quint64 timestamp = 0;
+    QPoint pos;
+    QPoint angleDelta;
+    Qt::MouseButton button = Qt::NoButton;
+    Qt::MouseButtons buttons;
+    Qt::KeyboardModifiers modifiers;
+    int key = 0;
+    QString text;
+};
+
+class InputThread : public QThread
+{
+public:
+    explicit InputThread(int wakeFd);
+    ~InputThread();
+
+    // 只能在主线程调用
+    bool takeEvent(InputEvent *event);
+    void setCursorBoundsRect(const QRect &rect);
+    void warpCursor(const QPoint &pos);
+    void stop();
+
+protected:
+    void run() override;
+
+private:
+    void dispatch();
+    void post(InputEvent &&event);
+    bool flushOverflow();
+    void wakeMainThread();
+    void processEvent(libinput_event *ev);
+    void processButton(libinput_event_pointer *e);
+    void processMotion(libinput_event_pointer *e);
+    void processAbsMotion(libinput_event_pointer *e);
+    void processAxis(libinput_event_pointer *e);
+    void processKey(libinput_event_keyboard *e);
+
+    udev *m_udev;
+    libinput *m_li;
+    int m_liFd;
+    int m_wakeFd;
+    int m_stopFd;
+    bool m_posted = false;
+
+    SpscQueue<InputEvent, 1024> m_queue;
+    // 队列满时积压在输入线程的事件，按顺序在队列有空位时放入
+    QList<InputEvent> m_overflow;
+
+    // 以下状态只在输入线程中访问
+    int m_pointerDeviceCount = 0;
+    int m_keyboardDeviceCount = 0;
+
+    Qt::MouseButtons m_buttons;
+    Qt::KeyboardModifiers m_keyModifiers = Qt::NoModifier;
+    QPoint m_cursorPos;
+    QRect m_bounds;
+
+    xkb_context *m_ctx = nullptr;
+    xkb_keymap *m_keymap = nullptr;
+    xkb_state *m_state = nullptr;
+
+    // 主线程设置，输入线程在每次处理事件前读取
+    QMutex m_lock;
+    QRect m_cursorBoundsRect;
+    QPoint m_warpPos;
+    bool m_warp = false;
+};
+
 // Begin copy from qtbase project
-Input::Input(QObject *parent)
-    : QObject{parent}
+InputThread::InputThread(int wakeFd)
+    : m_wakeFd(wakeFd)
+    , m_stopFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
 {
+    setObjectName(QStringLiteral("InputThread"));
+
     m_udev = udev_new();
     if (Q_UNLIKELY(!m_udev))
         qFatal("Failed to get udev context for libinput");
@@ -66,11 +163,6 @@ Input::Input(QObject *parent)
         qFatal("Failed to assign seat");
 
     m_liFd = libinput_get_fd(m_li);
-    m_notifier.reset(new QSocketNotifier(m_liFd, QSocketNotifier::Read));
-
-    connect(m_notifier.data(), &QSocketNotifier::activated, this, &Input::onReadyRead);
-    // Process the initial burst of DEVICE_ADDED events.
-    onReadyRead();
 
     qDebug() << "Using xkbcommon for key mapping";
     m_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
@@ -90,7 +182,7 @@ Input::Input(QObject *parent)
     }
 }
 
-Input::~Input()
+InputThread::~InputThread()
 {
     if (m_state)
         xkb_state_unref(m_state);
@@ -98,23 +190,140 @@ Input::~Input()
         xkb_keymap_unref(m_keymap);
     if (m_ctx)
         xkb_context_unref(m_ctx);
+
+    libinput_unref(m_li);
+    udev_unref(m_udev);
+    close(m_stopFd);
+}
+
+bool InputThread::takeEvent(InputEvent *event)
+{
+    return m_queue.pop(event);
+}
+
+void InputThread::setCursorBoundsRect(const QRect &rect)
+{
+    QMutexLocker locker(&m_lock);
+    m_cursorBoundsRect = rect;
 }
 
-void Input::onReadyRead()
+void InputThread::warpCursor(const QPoint &pos)
+{
+    QMutexLocker locker(&m_lock);
+    m_warpPos = pos;
+    m_warp = true;
+}
+
+void InputThread::stop()
+{
+    const quint64 value = 1;
+    if (write(m_stopFd, &value, sizeof(value)) != sizeof(value))
+        qWarning("Failed to stop the input thread");
+}
+
+void InputThread::run()
+{
+    pollfd fds[2] = {
+        { m_liFd, POLLIN, 0 },
+        { m_stopFd, POLLIN, 0 }
+    };
+
+    // Process the initial burst of DEVICE_ADDED events.
+    dispatch();
+
+    while (true) {
+        // 主线程取走事件时不会通知输入线程，有积压时定期重试
+        if (poll(fds, 2, m_overflow.isEmpty() ? -1 : OverflowRetryInterval) < 0) {
+            if (errno == EINTR)
+                continue;
+            qWarning("Failed to poll libinput fd: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        if (fds[0].revents & POLLIN)
+            dispatch();
+        else if (flushOverflow())
+            wakeMainThread();
+    }
+}
+
+void InputThread::dispatch()
 {
     if (libinput_dispatch(m_li)) {
         qWarning("libinput_dispatch failed");
         return;
     }
 
+    {
+        QMutexLocker locker(&m_lock);
+        m_bounds = m_cursorBoundsRect;
+        if (m_warp) {
+            m_cursorPos = m_warpPos;
+            m_warp = false;
+        }
+    }
+
     libinput_event *ev;
     while ((ev = libinput_get_event(m_li)) != nullptr) {
         processEvent(ev);
         libinput_event_destroy(ev);
     }
+
+    // 每批事件只唤醒主线程一次
+    if (m_posted)
+        wakeMainThread();
+}
+
+void InputThread::wakeMainThread()
+{
+    m_posted = false;
+    const quint64 value = 1;
+    if (write(m_wakeFd, &value, sizeof(value)) != sizeof(value))
+        qWarning("Failed to wake up the main thread");
+}
+
+void InputThread::post(InputEvent &&event)
+{
+    // 积压的事件先于新的事件放入队列
+    flushOverflow();
+    if (m_overflow.isEmpty() && m_queue.push(std::move(event))) {
+        m_posted = true;
+        return;
+    }
+
+    // 主线程长时间阻塞时不阻塞输入线程，也不丢弃事件：连续的移动事件只保留
+    // 最新的位置，按键和按钮事件全部保留，避免按键卡在按下的状态
+    if (m_overflow.isEmpty())
+        qWarning("Input event queue is full, coalesce pointer motion");
+
+    if (event.kind == InputEvent::Mouse && event.type == QEvent::MouseMove
+        && !m_overflow.isEmpty() && m_overflow.last().kind == InputEvent::Mouse
+        && m_overflow.last().type == QEvent::MouseMove) {
+        m_overflow.last() = std::move(event);
+    } else {
+        m_overflow.append(std::move(event));
+    }
+}
+
+// 把积压的事件放入队列，返回是否放入了事件
+bool InputThread::flushOverflow()
+{
+    int count = 0;
+    while (count < m_overflow.size() && m_queue.push(std::move(m_overflow[count])))
+        ++count;
+
+    if (count == 0)
+        return false;
+
+    m_overflow.remove(0, count);
+    m_posted = true;
+    return true;
 }
 
-void Input::processEvent(libinput_event *ev)
+void InputThread::processEvent(libinput_event *ev)
 {
     libinput_event_type type = libinput_event_get_type(ev);
     libinput_device *dev = libinput_event_get_device(ev);
@@ -124,11 +333,15 @@ void Input::processEvent(libinput_event *ev)
     {
         if (libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_POINTER)) {
             ++m_pointerDeviceCount;
-            Q_EMIT pointerDeviceChanged();
+            InputEvent event;
+            event.kind = InputEvent::PointerDeviceChanged;
+            post(std::move(event));
         }
         if (libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_KEYBOARD)) {
             ++m_keyboardDeviceCount;
-            Q_EMIT keyboardDeviceChanged();
+            InputEvent event;
+            event.kind = InputEvent::KeyboardDeviceChanged;
+            post(std::move(event));
         }
         break;
     }
@@ -136,11 +349,15 @@ void Input::processEvent(libinput_event *ev)
     {
         if (libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_POINTER)) {
             --m_pointerDeviceCount;
-            Q_EMIT pointerDeviceChanged();
+            InputEvent event;
+            event.kind = InputEvent::PointerDeviceChanged;
+            post(std::move(event));
         }
         if (libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_KEYBOARD)) {
             --m_keyboardDeviceCount;
-            Q_EMIT keyboardDeviceChanged();
+            InputEvent event;
+            event.kind = InputEvent::KeyboardDeviceChanged;
+            post(std::move(event));
         }
         break;
     }
@@ -164,7 +381,7 @@ void Input::processEvent(libinput_event *ev)
     }
 }
 
-void Input::processButton(libinput_event_pointer *e)
+void InputThread::processButton(libinput_event_pointer *e)
 {
     const uint32_t b = libinput_event_pointer_get_button(e);
     const bool pressed = libinput_event_pointer_get_button_state(e) == LIBINPUT_BUTTON_STATE_PRESSED;
@@ -191,44 +408,59 @@ void Input::processButton(libinput_event_pointer *e)
 
     m_buttons.setFlag(button, pressed);
 
-    QEvent::Type type = pressed ? QEvent::MouseButtonPress : QEvent::MouseButtonRelease;
-    QMouseEvent event(type, m_cursorPos, m_cursorPos, button, m_buttons, m_keyModifiers);
-    qApp->sendEvent(this, &event);
+    InputEvent event;
+    event.type = pressed ? QEvent::MouseButtonPress : QEvent::MouseButtonRelease;
+    event.timestamp = libinput_event_pointer_get_time_usec(e) / 1000;
+    event.pos = m_cursorPos;
+    event.button = button;
+    event.buttons = m_buttons;
+    event.modifiers = m_keyModifiers;
+    post(std::move(event));
 }
 
-void Input::processMotion(libinput_event_pointer *e)
+void InputThread::processMotion(libinput_event_pointer *e)
 {
-    const auto g = m_cursorBoundsRect;
+    const auto g = m_bounds;
     if (g.isEmpty())
         return;
 
     const double dx = libinput_event_pointer_get_dx(e);
     const double dy = libinput_event_pointer_get_dy(e);
 
-    setCursorPosition({qBound(g.left(), qRound(m_cursorPos.x() + dx), g.right()),
-                       qBound(g.top(), qRound(m_cursorPos.y() + dy), g.bottom())});
+    m_cursorPos = QPoint(qBound(g.left(), qRound(m_cursorPos.x() + dx), g.right()),
+                         qBound(g.top(), qRound(m_cursorPos.y() + dy), g.bottom()));
 
-    QMouseEvent event(QEvent::MouseMove, m_cursorPos, m_cursorPos, Qt::NoButton, m_buttons, m_keyModifiers);
-    qApp->sendEvent(this, &event);
+    InputEvent event;
+    event.type = QEvent::MouseMove;
+    event.timestamp = libinput_event_pointer_get_time_usec(e) / 1000;
+    event.pos = m_cursorPos;
+    event.buttons = m_buttons;
+    event.modifiers = m_keyModifiers;
+    post(std::move(event));
 }
 
-void Input::processAbsMotion(libinput_event_pointer *e)
+void InputThread::processAbsMotion(libinput_event_pointer *e)
 {
-    const auto g = m_cursorBoundsRect;
+    const auto g = m_bounds;
     if (g.isEmpty())
         return;
 
     const double x = libinput_event_pointer_get_absolute_x_transformed(e, g.width());
     const double y = libinput_event_pointer_get_absolute_y_transformed(e, g.height());
 
-    setCursorPosition({qBound(g.left(), qRound(g.left() + x), g.right()),
-                       qBound(g.top(), qRound(g.top() + y), g.bottom())});
+    m_cursorPos = QPoint(qBound(g.left(), qRound(g.left() + x), g.right()),
+                         qBound(g.top(), qRound(g.top() + y), g.bottom()));
 
-    QMouseEvent event(QEvent::MouseMove, m_cursorPos, m_cursorPos, Qt::NoButton, m_buttons, m_keyModifiers);
-    qApp->sendEvent(this, &event);
+    InputEvent event;
+    event.type = QEvent::MouseMove;
+    event.timestamp = libinput_event_pointer_get_time_usec(e) / 1000;
+    event.pos = m_cursorPos;
+    event.buttons = m_buttons;
+    event.modifiers = m_keyModifiers;
+    post(std::move(event));
 }
 
-void Input::processAxis(libinput_event_pointer *e)
+void InputThread::processAxis(libinput_event_pointer *e)
 {
     double value; // default axis value is 15 degrees per wheel click
     QPoint angleDelta;
@@ -246,12 +478,18 @@ void Input::processAxis(libinput_event_pointer *e)
     const int factor = -8;
     angleDelta *= factor;
 
-    QWheelEvent event(m_cursorPos, m_cursorPos, QPoint(), angleDelta, m_buttons, m_keyModifiers,
-                      Qt::NoScrollPhase, false);
-    qApp->sendEvent(this, &event);
+    InputEvent event;
+    event.kind = InputEvent::Wheel;
+    event.type = QEvent::Wheel;
+    event.timestamp = libinput_event_pointer_get_time_usec(e) / 1000;
+    event.pos = m_cursorPos;
+    event.angleDelta = angleDelta;
+    event.buttons = m_buttons;
+    event.modifiers = m_keyModifiers;
+    post(std::move(event));
 }
 
-void Input::processKey(libinput_event_keyboard *e)
+void InputThread::processKey(libinput_event_keyboard *e)
 {
     if (!m_ctx || !m_keymap || !m_state)
         return;
@@ -272,12 +510,84 @@ void Input::processKey(libinput_event_keyboard *e)
 
     m_keyModifiers = QXkbCommon::modifiers(m_state);
 
-    QKeyEvent event(pressed ? QEvent::KeyPress : QEvent::KeyRelease, qtkey, m_keyModifiers, text);
-    qApp->sendEvent(this, &event);
+    InputEvent event;
+    event.kind = InputEvent::Key;
+    event.type = pressed ? QEvent::KeyPress : QEvent::KeyRelease;
+    event.timestamp = libinput_event_keyboard_get_time_usec(e) / 1000;
+    event.key = qtkey;
+    event.modifiers = m_keyModifiers;
+    event.text = text;
+    post(std::move(event));
 }
 
 // End copy from qtbase project
 
+Input::Input(QObject *parent)
+    : QObject{parent}
+    , m_wakeFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+    if (Q_UNLIKELY(m_wakeFd < 0))
+        qFatal("Failed to create eventfd for the input thread");
+
+    m_notifier.reset(new QSocketNotifier(m_wakeFd, QSocketNotifier::Read));
+    connect(m_notifier.data(), &QSocketNotifier::activated, this, &Input::onEventsReady);
+
+    m_thread.reset(new InputThread(m_wakeFd));
+    m_thread->start(QThread::TimeCriticalPriority);
+}
+
+Input::~Input()
+{
+    m_thread->stop();
+    m_thread->wait();
+    m_thread.reset();
+
+    m_notifier.reset();
+    close(m_wakeFd);
+}
+
+void Input::onEventsReady()
+{
+    quint64 value;
+    while (read(m_wakeFd, &value, sizeof(value)) > 0);
+
+    InputEvent ev;
+    while (m_thread->takeEvent(&ev)) {
+        switch (ev.kind) {
+        case InputEvent::PointerDeviceChanged:
+            Q_EMIT pointerDeviceChanged();
+            break;
+        case InputEvent::KeyboardDeviceChanged:
+            Q_EMIT keyboardDeviceChanged();
+            break;
+        case InputEvent::Mouse: {
+            if (ev.pos != m_cursorPos) {
+                m_cursorPos = ev.pos;
+                emit cursorPositionChanged();
+            }
+
+            QMouseEvent event(ev.type, ev.pos, ev.pos, ev.button, ev.buttons, ev.modifiers);
+            event.setTimestamp(ev.timestamp);
+            qApp->sendEvent(this, &event);
+            break;
+        }
+        case InputEvent::Wheel: {
+            QWheelEvent event(ev.pos, ev.pos, QPoint(), ev.angleDelta, ev.buttons, ev.modifiers,
+                              Qt::NoScrollPhase, false);
+            event.setTimestamp(ev.timestamp);
+            qApp->sendEvent(this, &event);
+            break;
+        }
+        case InputEvent::Key: {
+            QKeyEvent event(ev.type, ev.key, ev.modifiers, ev.text);
+            event.setTimestamp(ev.timestamp);
+            qApp->sendEvent(this, &event);
+            break;
+        }
+        }
+    }
+}
+
 QRect Input::cursorBoundsRect() const
 {
     return m_cursorBoundsRect;
@@ -288,6 +598,7 @@ void Input::setCursorBoundsRect(const QRect &newCursorBoundsRect)
     if (m_cursorBoundsRect == newCursorBoundsRect)
         return;
     m_cursorBoundsRect = newCursorBoundsRect;
+    m_thread->setCursorBoundsRect(newCursorBoundsRect);
     emit cursorBoundsRectChanged();
 }
 
@@ -308,6 +619,7 @@ void Input::setCursorPosition(const QPoint &pos)
         return;
 
     m_cursorPos = tmp;
+    m_thread->warpCursor(tmp);
     emit cursorPositionChanged();
 }
 
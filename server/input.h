@@ -5,18 +5,16 @@
 
 #include <QObject>
 #include <QRect>
-#include <xkbcommon/xkbcommon.h>
 
-struct udev;
-struct libinput;
-struct libinput_event;
-struct libinput_event_pointer;
-struct libinput_event_keyboard;
+#include <memory>
 
 QT_BEGIN_NAMESPACE
 class QSocketNotifier;
 QT_END_NAMESPACE
 
+class InputThread;
+// libinput 的读取、xkb 状态和光标位置的累积都在单独的 InputThread 中完成，
+// 解码后的事件经由无锁队列交给主线程，再以 QEvent 的形式派发
 class Input : public QObject
 {
     Q_OBJECT
@@ -40,31 +38,12 @@ signals:
     void cursorPositionChanged();
 
 private:
-    void onReadyRead();
-    void processEvent(libinput_event *ev);
-    void processButton(libinput_event_pointer *e);
-    void processMotion(libinput_event_pointer *e);
-    void processAbsMotion(libinput_event_pointer *e);
-    void processAxis(libinput_event_pointer *e);
-    void processKey(libinput_event_keyboard *e);
+    void onEventsReady();
 
-    udev *m_udev;
-    libinput *m_li;
-    int m_liFd;
+    std::unique_ptr<InputThread> m_thread;
+    int m_wakeFd = -1;
     QScopedPointer<QSocketNotifier> m_notifier;
 
-    int m_pointerDeviceCount = 0;
-    int m_keyboardDeviceCount = 0;
-
-    Qt::MouseButtons m_buttons;
-    Qt::KeyboardModifiers m_keyModifiers = Qt::NoModifier;
     QPoint m_cursorPos;
     QRect m_cursorBoundsRect;
-
-    int keysymToQtKey(xkb_keysym_t key) const;
-    int keysymToQtKey(xkb_keysym_t keysym, Qt::KeyboardModifiers *modifiers, const QString &text) const;
-
-    xkb_context *m_ctx = nullptr;
-    xkb_keymap *m_keymap = nullptr;
-    xkb_state *m_state = nullptr;
 };
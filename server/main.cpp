@@ -23,6 +23,8 @@ int main(int argc, char **argv)
 
     QObject::connect(&protocol, &Protocol::windowAdded, &compositor, &Compositor::addWindow);
     QObject::connect(&protocol, &Protocol::windowRemoved, &compositor, &Compositor::removeWindow);
+    QObject::connect(&protocol, &Protocol::captureAdded, &compositor, &Compositor::addCapture);
+    QObject::connect(&protocol, &Protocol::captureRemoved, &compositor, &Compositor::removeCapture);
 
     protocol.start();
 
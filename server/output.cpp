@@ -8,10 +8,13 @@
 #include <QThread>
 #include <QDebug>
 
+#include <cerrno>
+#include <cstring>
 #include <fcntl.h>
 #include <linux/fb.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 
 Output::Output(const QString &fbFile)
 {
@@ -41,20 +44,55 @@ QStringList Output::allFrmaebufferFiles()
     return files;
 }
 
-bool Output::waitForVSync()
+qint64 Output::monotonicTime()
 {
-    if (!m_fbFile.isOpen())
-        return true;
-
-    auto fb_fd = m_fbFile.handle();
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
 
-    while (true) {
+bool Output::waitForVSync()
+{
+    if (m_fbFile.isOpen() && m_hasVSync) {
+        auto fb_fd = m_fbFile.handle();
         struct fb_vblank vblank;
-        if (ioctl(fb_fd, FBIO_WAITFORVSYNC, &vblank) == 0)
+        int ret;
+        do {
+            ret = ioctl(fb_fd, FBIO_WAITFORVSYNC, &vblank);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == 0) {
+            m_lastVSyncTime.store(monotonicTime(), std::memory_order_relaxed);
             return true;
+        }
+
+        // 驱动不支持时不再重试，改为按刷新间隔模拟 vblank
+        qWarning() << "FBIO_WAITFORVSYNC failed, falling back to a timer:" << strerror(errno);
+        m_hasVSync = false;
     }
 
-    return false;
+    // 模拟的 vblank 与上一次 vblank 保持整数个刷新间隔
+    const qint64 now = monotonicTime();
+    const qint64 last = m_lastVSyncTime.load(std::memory_order_relaxed);
+    const qint64 next = now - (now - last) % m_refreshInterval + m_refreshInterval;
+
+    timespec ts;
+    ts.tv_sec = next / 1000000000;
+    ts.tv_nsec = next % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR);
+
+    m_lastVSyncTime.store(next, std::memory_order_relaxed);
+    return true;
+}
+
+qint64 Output::lastVSyncTime() const
+{
+    return m_lastVSyncTime.load(std::memory_order_relaxed);
+}
+
+qint64 Output::refreshInterval() const
+{
+    return m_refreshInterval;
 }
 
 void Output::init(const QString &fbFile)
@@ -85,6 +123,12 @@ void Output::init(const QString &fbFile)
     m_widthMM = vinfo.width;
     m_heightMM = vinfo.height;
 
+    // pixclock 的单位为皮秒，为 0 时表示驱动未提供时序信息
+    const qint64 htotal = vinfo.xres + vinfo.left_margin + vinfo.right_margin + vinfo.hsync_len;
+    const qint64 vtotal = vinfo.yres + vinfo.upper_margin + vinfo.lower_margin + vinfo.vsync_len;
+    if (vinfo.pixclock > 0 && htotal > 0 && vtotal > 0)
+        m_refreshInterval = qint64(vinfo.pixclock) * htotal * vtotal / 1000;
+
     QImage image(fb_ptr, vinfo.xres_virtual, vinfo.yres_virtual, QImage::Format_RGB32,
         [] (void *image) {
             auto &i = *reinterpret_cast<Output*>(image);
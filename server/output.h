@@ -6,15 +6,26 @@
 #include <QImage>
 #include <QFile>
 
+#include <atomic>
+
 class Output : public QImage
 {
 public:
+    // 驱动未提供时序信息时按 60Hz 计算
+    static constexpr qint64 DefaultRefreshInterval = 16666667;
+
     explicit Output(const QString &fbFile);
     ~Output();
 
     static QStringList allFrmaebufferFiles();
+    // CLOCK_MONOTONIC，单位为纳秒
+    static qint64 monotonicTime();
 
+    // 在送显线程中调用。驱动不支持 FBIO_WAITFORVSYNC 时按刷新间隔等待
     bool waitForVSync();
+    // 可在任意线程中读取
+    qint64 lastVSyncTime() const;
+    qint64 refreshInterval() const;
 
 private:
     void init(const QString &fbFile);
@@ -23,4 +34,7 @@ private:
 
     QFile m_fbFile;
     quint32 m_widthMM, m_heightMM;
+    std::atomic<qint64> m_lastVSyncTime { 0 };
+    bool m_hasVSync = true;
+    qint64 m_refreshInterval = DefaultRefreshInterval;
 };
@@ -3,38 +3,316 @@
 
 #include "protocol.h"
 #include "compositor.h"
+#include "connection.h"
+#include "shmpool.h"
+#include "capture.h"
+#include "fastpath.h"
+#include "inputring.h"
 
 #include <QLocalServer>
 #include <QLocalSocket>
-#include <QTimer>
+#include <QSocketNotifier>
 #include <QTimerEvent>
+#include <QRandomGenerator>
+#include <QFileInfo>
 #include <QDebug>
 
+#include <utility>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// 超过 IdleTimeout 没有收到消息的客户端会被 ping，之后 PingTimeout 内仍无回应则断开
+static constexpr qint64 IdleTimeout = 2000;
+static constexpr qint64 PingTimeout = 1000;
+// 输入队列有积压时重试写入的间隔
+static constexpr int InputRetryInterval = 4;
+// fastpath 连接建立后必须在这个时间内完成 Hello 握手
+static constexpr qint64 HelloTimeout = 1000;
+
 Protocol::Protocol(QObject *parent)
     : QObject{parent}
     , m_node(QUrl(QStringLiteral("local:X.STONE")))
 {
-
+    m_clock.start();
 }
 
 Protocol::~Protocol()
 {
-    for (auto client : m_clients) {
+    if (m_fastPathSocket >= 0) {
+        close(m_fastPathSocket);
+        unlink(FastPath::socketPath().constData());
+    }
+
+    for (auto client : m_clients.values()) {
         for (auto s : client->surfaces) {
             emit windowRemoved(s->m_window);
             s->deleteLater();
         }
+        for (auto s : client->screencasts) {
+            emit captureRemoved(s->m_capture);
+            s->deleteLater();
+        }
     }
 }
 
 void Protocol::start()
 {
     new Manager(this);
+
+    sockaddr_un addr;
+    if (!FastPath::fillAddress(&addr)) {
+        qWarning("The fastpath socket path is too long");
+        return;
+    }
+
+    m_fastPathSocket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (m_fastPathSocket < 0) {
+        qWarning() << "Can't create the fastpath socket:" << strerror(errno);
+        return;
+    }
+
+    unlink(addr.sun_path);
+
+    if (bind(m_fastPathSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+        || listen(m_fastPathSocket, 16) < 0) {
+        qWarning() << "Can't listen on" << addr.sun_path << strerror(errno);
+        close(m_fastPathSocket);
+        m_fastPathSocket = -1;
+        return;
+    }
+
+    m_fastPathNotifier = new QSocketNotifier(m_fastPathSocket, QSocketNotifier::Read, this);
+    connect(m_fastPathNotifier, &QSocketNotifier::activated, this, &Protocol::onFastPathConnection);
 }
 
 void Protocol::stop()
 {
     m_node.disableRemoting(this);
+
+    if (m_fastPathSocket >= 0) {
+        delete m_fastPathNotifier;
+        m_fastPathNotifier = nullptr;
+        close(m_fastPathSocket);
+        m_fastPathSocket = -1;
+        unlink(FastPath::socketPath().constData());
+    }
+}
+
+qint64 Protocol::now() const
+{
+    return m_clock.elapsed();
+}
+
+void Protocol::scheduleLiveness(Client *client, qint64 deadline)
+{
+    Q_ASSERT(client->wheelSlot < 0);
+
+    // 超出时间轮范围的截止时间放到最远的槽，到期时再重新计算
+    const qint64 ticks = qBound<qint64>(1, (deadline - now() + WheelTick - 1) / WheelTick, WheelSlots - 1);
+    client->wheelSlot = (m_wheelSlot + ticks) % WheelSlots;
+    m_wheel[client->wheelSlot].append(client);
+
+    if (!m_wheelTimer.isActive())
+        m_wheelTimer.start(WheelTick, Qt::CoarseTimer, this);
+}
+
+void Protocol::unscheduleLiveness(Client *client)
+{
+    if (client->wheelSlot < 0)
+        return;
+
+    m_wheel[client->wheelSlot].removeOne(client);
+    client->wheelSlot = -1;
+}
+
+void Protocol::checkLiveness()
+{
+    m_wheelSlot = (m_wheelSlot + 1) % WheelSlots;
+    const auto clients = std::exchange(m_wheel[m_wheelSlot], {});
+    const qint64 time = now();
+
+    for (auto client : clients) {
+        client->wheelSlot = -1;
+
+        // 不在 touch 时移动客户端，到期时才根据最近的活动时间重新放入时间轮
+        if (client->pingTime >= 0 && client->lastActivity < client->pingTime) {
+            if (time - client->pingTime >= PingTimeout) {
+                emit client->disconnected();
+                continue;
+            }
+
+            scheduleLiveness(client, client->pingTime + PingTimeout);
+            continue;
+        }
+
+        if (time - client->lastActivity >= IdleTimeout) {
+            client->pingTime = time;
+            emit client->ping();
+            scheduleLiveness(client, time + PingTimeout);
+            continue;
+        }
+
+        client->pingTime = -1;
+        scheduleLiveness(client, client->lastActivity + IdleTimeout);
+    }
+
+    for (const auto &slot : m_wheel) {
+        if (!slot.isEmpty())
+            return;
+    }
+
+    // 没有客户端时不再唤醒
+    m_wheelTimer.stop();
+}
+
+void Protocol::checkHandshakes()
+{
+    const qint64 time = now();
+
+    // 按建立连接的顺序排列，截止时间也是递增的
+    while (!m_handshakes.isEmpty()) {
+        const Handshake &handshake = m_handshakes.first();
+        if (handshake.connection && handshake.deadline > time)
+            break;
+
+        if (auto connection = m_handshakes.takeFirst().connection) {
+            qWarning() << "Fastpath connection did not say Hello in time";
+            connection->close();
+        }
+    }
+
+    if (m_handshakes.isEmpty())
+        m_handshakeTimer.stop();
+    else
+        m_handshakeTimer.start(int(m_handshakes.first().deadline - time), this);
+}
+
+void Protocol::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() == m_wheelTimer.timerId()) {
+        checkLiveness();
+        return;
+    }
+
+    if (event->timerId() == m_handshakeTimer.timerId()) {
+        checkHandshakes();
+        return;
+    }
+
+    QObject::timerEvent(event);
+}
+
+void Protocol::onFastPathConnection()
+{
+    int socket = accept4(m_fastPathSocket, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (socket < 0)
+        return;
+
+    // 握手完成前由 Protocol 持有，之后转交给对应的 Client
+    auto connection = new Connection(socket, this);
+    connection->setHandler([this, connection] (const FastPath::Header *message) {
+        handleHello(connection, message);
+    });
+    connect(connection, &Connection::closed, connection, &QObject::deleteLater);
+
+    // 不发送 Hello 的连接不能一直占用
+    m_handshakes.append({ connection, now() + HelloTimeout });
+    if (!m_handshakeTimer.isActive())
+        m_handshakeTimer.start(int(HelloTimeout), this);
+}
+
+// 比较时间与内容无关
+static bool tokenEquals(const QByteArray &token, const char *data)
+{
+    if (token.size() != FastPath::TokenSize)
+        return false;
+
+    char diff = 0;
+    for (int i = 0; i < FastPath::TokenSize; ++i)
+        diff |= token.at(i) ^ data[i];
+    return diff == 0;
+}
+
+void Protocol::handleHello(Connection *connection, const FastPath::Header *message)
+{
+    // 无论握手成功与否都不再需要超时检查
+    m_handshakes.removeIf([connection] (const Handshake &handshake) {
+        return handshake.connection == connection;
+    });
+
+    if (message->opcode != FastPath::Hello || message->size != sizeof(FastPath::HelloMessage)) {
+        qWarning() << "The first fastpath message must be Hello, got:" << message->opcode;
+        connection->close();
+        return;
+    }
+
+    auto hello = reinterpret_cast<const FastPath::HelloMessage*>(message);
+    const QString id = QString::fromUtf8(hello->clientId, qstrnlen(hello->clientId, sizeof(hello->clientId)));
+
+    auto client = findClient(id);
+    if (!client) {
+        qWarning() << "Unknown client connects to fastpath:" << id;
+        connection->close();
+        return;
+    }
+
+    // id 可以被猜到，token 只有调用 createClient 的进程才知道
+    if (!tokenEquals(client->fastPathToken, hello->token)) {
+        qWarning() << "Wrong fastpath token for client" << id;
+        connection->close();
+        return;
+    }
+
+    // 已经建立的连接不会被替换
+    if (client->connection && client->connection->isValid()) {
+        qWarning() << "Client" << id << "is already connected to fastpath";
+        connection->close();
+        return;
+    }
+
+    if (!client->shmPool->isValid()) {
+        connection->close();
+        return;
+    }
+
+    auto pool = FastPath::message<FastPath::PoolMessage>(FastPath::Pool);
+    pool.capacity = client->shmPool->capacity();
+    if (!connection->sendFd(client->shmPool->fd(), &pool, sizeof(pool))) {
+        qWarning() << "Can't send shm pool to client" << id;
+        connection->close();
+        return;
+    }
+
+    client->setConnection(connection);
+}
+
+// QtRO 的对象名由 handle 生成，查找时再解析回 handle
+static QString clientName(quint32 handle)
+{
+    return QStringLiteral("Client-%1").arg(handle);
+}
+
+static QString surfaceName(quint32 handle)
+{
+    return QStringLiteral("Surface-%1").arg(handle);
+}
+
+static QString screencastName(quint32 handle)
+{
+    return QStringLiteral("Screencast-%1").arg(handle);
+}
+
+Client *Protocol::findClient(const QString &id) const
+{
+    static const QString prefix = QStringLiteral("Client-");
+    if (!id.startsWith(prefix))
+        return nullptr;
+
+    bool ok = false;
+    const quint32 handle = QStringView(id).mid(prefix.size()).toUInt(&ok);
+    return ok ? m_clients.value(handle) : nullptr;
 }
 
 Manager::Manager(Protocol *parent)
@@ -48,45 +326,68 @@ Protocol *Manager::parent()
     return static_cast<Protocol*>(QObject::parent());
 }
 
-QString Manager::createClient()
+ClientInfo Manager::createClient()
 {
     auto client = new Client(parent());
-    parent()->m_clients << client;
 
     connect(client, &Client::disconnected, this, [client, this] {
         Q_ASSERT(client->parent() == parent());
         destroyClient(client->objectName());
     });
 
-    return client->objectName();
+    return ClientInfo(client->objectName(), client->fastPathToken);
 }
 
 void Manager::destroyClient(const QString &id)
 {
     qDebug() << "Destroy client:" << id;
 
-    auto client = parent()->findChild<Client*>(id);
-    parent()->m_clients.removeOne(client);
+    auto client = parent()->findClient(id);
+    if (!client)
+        return;
+
+    parent()->m_clients.remove(client->handle);
+    parent()->unscheduleLiveness(client);
 
     for (auto s : client->surfaces) {
+        parent()->m_surfaces.remove(s->m_handle);
         emit parent()->windowRemoved(s->m_window);
         s->deleteLater();
     }
 
-    if (client)
-        client->deleteLater();
-}
+    for (auto s : client->screencasts) {
+        parent()->m_screencasts.remove(s->m_handle);
+        emit parent()->captureRemoved(s->m_capture);
+        s->deleteLater();
+    }
 
-inline static QString getID(void *ptr) {
-    return "0x" + QString::number(reinterpret_cast<quintptr>(ptr), 16);
+    client->deleteLater();
 }
 
 Client::Client(Protocol *parent)
     : ClientSource(parent)
 {
-    setObjectName(getID(this));
+    handle = parent->m_clients.insert(this);
+    setObjectName(clientName(handle));
     parent->m_node.enableRemoting(this, objectName());
-    doPing();
+    shmPool = std::make_shared<ShmPool>();
+    if (!shmPool->isValid())
+        qWarning() << "Can't create shm pool for client" << objectName();
+
+    fastPathToken.resize(FastPath::TokenSize);
+    QRandomGenerator::system()->fillRange(reinterpret_cast<quint32*>(fastPathToken.data()),
+                                          FastPath::TokenSize / sizeof(quint32));
+
+    lastActivity = parent->now();
+    parent->scheduleLiveness(this, lastActivity + IdleTimeout);
+}
+
+Client::~Client()
+{
+    if (inputRingFd >= 0)
+        close(inputRingFd);
+    if (inputRingOffset >= 0)
+        shmPool->free(inputRingOffset);
 }
 
 Protocol *Client::parent()
@@ -96,6 +397,7 @@ Protocol *Client::parent()
 
 QString Client::createSurface()
 {
+    touch();
     auto surface = new Surface(new Window(), this, parent());
     surfaces << surface;
 
@@ -104,36 +406,222 @@ QString Client::createSurface()
     return surface->objectName();
 }
 
-void Client::doPing()
+// 录屏能看到所有窗口的内容，默认不开放。XSTONE_SCREENCAST_ALLOW 为允许使用的
+// 可执行文件路径，以 ':' 分隔，"*" 表示允许所有客户端
+static bool screencastAllowed(Connection *connection)
 {
-// #ifdef QT_NO_DEBUG
-    pingTimer = startTimer(std::chrono::seconds(1));
-    emit ClientSource::ping();
-// #endif
+    static const QStringList allowed = qEnvironmentVariable("XSTONE_SCREENCAST_ALLOW")
+                                           .split(u':', Qt::SkipEmptyParts);
+    if (allowed.contains(QLatin1String("*")))
+        return true;
+
+    // 可执行文件通过 fastpath 连接的对端凭据确定，QtRO 无法提供
+    const pid_t pid = connection ? connection->peerPid() : -1;
+    if (pid <= 0)
+        return false;
+
+    const QString executable = QFileInfo(QStringLiteral("/proc/%1/exe").arg(pid)).symLinkTarget();
+    return !executable.isEmpty() && allowed.contains(executable);
+}
+
+QString Client::createScreencast()
+{
+    touch();
+    if (!screencastAllowed(connection)) {
+        qWarning() << "Client" << objectName() << "is not allowed to capture the screen";
+        return QString();
+    }
+
+    auto screencast = new Screencast(new Capture(), this, parent());
+    screencasts << screencast;
+
+    return screencast->objectName();
 }
 
 void Client::pong()
 {
-    if (pingTimer > 0)
-        killTimer(pingTimer);
-    QTimer::singleShot(std::chrono::seconds(2), this, &Client::doPing);
+    touch();
+}
+
+void Client::touch()
+{
+    lastActivity = parent()->now();
 }
 
 void Client::destroySurface(Surface *surface)
 {
     Q_ASSERT(surface);
     surfaces.removeOne(surface);
+    parent()->m_surfaces.remove(surface->m_handle);
     emit parent()->windowRemoved(surface->m_window);
     surface->m_client = nullptr;
     surface->deleteLater();
 }
 
+void Client::destroyScreencast(Screencast *screencast)
+{
+    Q_ASSERT(screencast);
+    screencasts.removeOne(screencast);
+    parent()->m_screencasts.remove(screencast->m_handle);
+    emit parent()->captureRemoved(screencast->m_capture);
+    screencast->m_client = nullptr;
+    screencast->deleteLater();
+}
+
+void Client::setConnection(Connection *connection)
+{
+    Q_ASSERT(!this->connection || !this->connection->isValid());
+    this->connection = connection;
+    connection->setParent(this);
+    connection->setHandler([this] (const FastPath::Header *message) {
+        handleMessage(message);
+    });
+}
+
+void Client::handleMessage(const FastPath::Header *message)
+{
+    touch();
+    switch (message->opcode) {
+    case FastPath::Commit:
+        handleCommit(message);
+        break;
+    case FastPath::EnableInputRing:
+        enableInputRing();
+        break;
+    default:
+        qWarning() << "Unexpected fastpath message from client" << objectName() << message->opcode;
+        break;
+    }
+}
+
+void Client::handleCommit(const FastPath::Header *message)
+{
+    auto commit = reinterpret_cast<const FastPath::CommitMessage*>(message);
+    if (commit->rectCount > FastPath::CommitMessage::MaxRects
+        || message->size != FastPath::commitSize(*commit)) {
+        qWarning() << "Invalid commit message from client" << objectName();
+        return;
+    }
+
+    // 只能提交到属于自己的 Surface
+    auto surface = parent()->m_surfaces.value(message->surface);
+    if (!surface || surface->m_client != this || !surface->m_window)
+        return;
+
+    QRegion region;
+    for (quint32 i = 0; i < commit->rectCount; ++i) {
+        const auto &r = commit->rects[i];
+        region += QRect(r.x, r.y, r.width, r.height);
+    }
+
+    const bool ok = (commit->flags & FastPath::CommitMessage::Copy)
+                        ? surface->m_window->putImage(commit->buffer, region)
+                        : surface->m_window->commit(commit->buffer, region);
+    if (!ok) {
+        auto failed = FastPath::message<FastPath::BufferMessage>(FastPath::CommitFailed, message->surface);
+        failed.buffer = commit->buffer;
+        connection->send(failed);
+    }
+}
+
+void Client::enableInputRing()
+{
+    if (inputRingOffset >= 0 || !shmPool->isValid())
+        return;
+
+    const qint64 offset = shmPool->allocate(InputRing::Size);
+    if (offset < 0) {
+        qWarning() << "Can't allocate input ring for client" << objectName();
+        return;
+    }
+
+    const int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        shmPool->free(offset);
+        return;
+    }
+
+    auto ring = reinterpret_cast<InputRing::Header*>(shmPool->data() + offset);
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->dropped.store(0, std::memory_order_relaxed);
+
+    auto msg = FastPath::message<FastPath::InputRingMessage>(FastPath::InputRing);
+    msg.offset = offset;
+    if (!connection->sendFd(fd, &msg, sizeof(msg))) {
+        qWarning() << "Can't send input ring to client" << objectName();
+        close(fd);
+        shmPool->free(offset);
+        return;
+    }
+
+    inputRingOffset = offset;
+    inputRingFd = fd;
+}
+
+static bool isMotion(const InputRing::Record &record)
+{
+    return record.kind == InputRing::Record::Mouse && record.type == QEvent::MouseMove;
+}
+
+// 返回 false 表示没有启用共享内存输入队列，由调用者改用其它方式发送
+bool Client::pushInput(const InputRing::Record &record)
+{
+    if (inputRingOffset < 0)
+        return false;
+
+    // 积压的事件先于新的事件写入
+    flushInput();
+    if (inputBacklog.isEmpty() && writeInput(record))
+        return true;
+
+    // 客户端处理不及时，队列已满。事件不能丢弃，否则按键和按钮会卡在按下的
+    // 状态；只有连续的移动事件可以合并
+    if (isMotion(record) && !inputBacklog.isEmpty() && isMotion(inputBacklog.last())
+        && inputBacklog.last().surface == record.surface) {
+        inputBacklog.last() = record;
+        auto ring = reinterpret_cast<InputRing::Header*>(shmPool->data() + inputRingOffset);
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        inputBacklog.append(record);
+    }
+
+    if (!inputTimer.isActive())
+        inputTimer.start(InputRetryInterval, this);
+    return true;
+}
+
+bool Client::writeInput(const InputRing::Record &record)
+{
+    auto ring = reinterpret_cast<InputRing::Header*>(shmPool->data() + inputRingOffset);
+    bool wake = false;
+    if (!InputRing::push(ring, record, &wake))
+        return false;
+
+    if (wake) {
+        const quint64 value = 1;
+        if (write(inputRingFd, &value, sizeof(value)) != sizeof(value))
+            qWarning() << "Can't wake up client" << objectName();
+    }
+
+    return true;
+}
+
+void Client::flushInput()
+{
+    qsizetype count = 0;
+    while (count < inputBacklog.size() && writeInput(inputBacklog.at(count)))
+        ++count;
+    inputBacklog.remove(0, count);
+
+    if (inputBacklog.isEmpty())
+        inputTimer.stop();
+}
+
 void Client::timerEvent(QTimerEvent *event)
 {
-    if (event->timerId() == pingTimer) {
-        killTimer(pingTimer);
-        pingTimer = 0;
-        emit disconnected();
+    if (event->timerId() == inputTimer.timerId()) {
+        flushInput();
         return;
     }
 
@@ -144,14 +632,24 @@ Surface::Surface(Window *window, Client *client, Protocol *parent)
     : SurfaceSource(parent)
     , m_window(window)
     , m_client(client)
+    , m_handle(parent->m_surfaces.insert(this))
 {
     connect(window, &Window::geometryChanged, this, &Surface::geometryChanged);
     connect(window, &Window::visibleChanged, this, &Surface::visibleChanged);
-    connect(window, &Window::mouseEvent, this, &Surface::mouseEvent);
-    connect(window, &Window::wheelEvent, this, &Surface::wheelEvent);
-    connect(window, &Window::keyEvent, this, &Surface::keyEvent);
-
-    setObjectName(getID(this));
+    connect(window, &Window::mouseEvent, this, &Surface::sendMouseEvent);
+    connect(window, &Window::wheelEvent, this, &Surface::sendWheelEvent);
+    connect(window, &Window::keyEvent, this, &Surface::sendKeyEvent);
+    connect(window, &Window::bufferReleased, this, &Surface::sendBufferReleased);
+    connect(window, &Window::frameDone, this, &Surface::sendFrameDone);
+    connect(window, &Window::presented, this, &Surface::sendPresented);
+    connect(window, &Window::repaintRequested, this, &Surface::repaintRequested);
+
+    if (client->shmPool->isValid())
+        window->setShmPool(client->shmPool);
+
+    setObjectName(surfaceName(m_handle));
+    // 调试时用来标明窗口属于哪个客户端
+    window->setObjectName(client->objectName() + QLatin1Char('/') + objectName());
     parent->m_node.enableRemoting(this, objectName());
 }
 
@@ -167,6 +665,7 @@ QRect Surface::geometry() const
 
 void Surface::setGeometry(QRect geometry)
 {
+    touch();
     m_window->setGeometry(geometry);
 }
 
@@ -177,9 +676,187 @@ bool Surface::visible() const
 
 void Surface::setVisible(bool visible)
 {
+    touch();
     m_window->setVisible(visible);
 }
 
+void Surface::touch()
+{
+    if (m_client)
+        m_client->touch();
+}
+
+quint32 Surface::handle() const
+{
+    return m_handle;
+}
+
+Connection *Surface::connection() const
+{
+    if (!m_client || !m_client->connection || !m_client->connection->isValid())
+        return nullptr;
+    return m_client->connection;
+}
+
+bool Surface::sendInput(const InputRing::Record &record)
+{
+    return m_client && connection() && m_client->pushInput(record);
+}
+
+void Surface::sendMouseEvent(QEvent::Type type, QPoint local, QPoint global,
+                             Qt::MouseButton button, Qt::MouseButtons buttons,
+                             Qt::KeyboardModifiers modifiers)
+{
+    InputRing::Record record = {};
+    record.surface = m_handle;
+    record.kind = InputRing::Record::Mouse;
+    record.type = type;
+    record.localX = local.x();
+    record.localY = local.y();
+    record.globalX = global.x();
+    record.globalY = global.y();
+    record.button = button;
+    record.buttons = quint32(buttons);
+    record.modifiers = quint32(modifiers);
+    if (sendInput(record))
+        return;
+
+    auto connection = this->connection();
+    if (!connection) {
+        emit mouseEvent(type, local, global, button, buttons, modifiers);
+        return;
+    }
+
+    auto msg = FastPath::message<FastPath::MouseMessage>(FastPath::MouseEvent, m_handle);
+    msg.type = type;
+    msg.localX = local.x();
+    msg.localY = local.y();
+    msg.globalX = global.x();
+    msg.globalY = global.y();
+    msg.button = button;
+    msg.buttons = quint32(buttons);
+    msg.modifiers = quint32(modifiers);
+    connection->send(msg);
+}
+
+void Surface::sendWheelEvent(QPoint local, QPoint global, QPoint angleDelta,
+                             Qt::MouseButtons buttons, Qt::KeyboardModifiers modifiers)
+{
+    InputRing::Record record = {};
+    record.surface = m_handle;
+    record.kind = InputRing::Record::Wheel;
+    record.type = QEvent::Wheel;
+    record.localX = local.x();
+    record.localY = local.y();
+    record.globalX = global.x();
+    record.globalY = global.y();
+    record.angleDeltaX = angleDelta.x();
+    record.angleDeltaY = angleDelta.y();
+    record.buttons = quint32(buttons);
+    record.modifiers = quint32(modifiers);
+    if (sendInput(record))
+        return;
+
+    auto connection = this->connection();
+    if (!connection) {
+        emit wheelEvent(local, global, angleDelta, buttons, modifiers);
+        return;
+    }
+
+    auto msg = FastPath::message<FastPath::WheelMessage>(FastPath::WheelEvent, m_handle);
+    msg.localX = local.x();
+    msg.localY = local.y();
+    msg.globalX = global.x();
+    msg.globalY = global.y();
+    msg.angleDeltaX = angleDelta.x();
+    msg.angleDeltaY = angleDelta.y();
+    msg.buttons = quint32(buttons);
+    msg.modifiers = quint32(modifiers);
+    connection->send(msg);
+}
+
+void Surface::sendKeyEvent(QEvent::Type type, int qtkey, Qt::KeyboardModifiers modifiers,
+                           QString text)
+{
+    auto connection = this->connection();
+    if (!connection) {
+        emit keyEvent(type, qtkey, modifiers, text);
+        return;
+    }
+
+    // 长文本拆成多段，与其它输入事件走同一条通道，保证事件的顺序
+    constexpr qsizetype ChunkSize = FastPath::KeyMessage::MaxTextLength;
+    static_assert(ChunkSize == InputRing::Record::MaxTextLength);
+
+    qsizetype offset = 0;
+    do {
+        const qsizetype length = qMin(text.size() - offset, ChunkSize);
+        const bool last = offset + length == text.size();
+
+        InputRing::Record record = {};
+        record.surface = m_handle;
+        record.kind = last ? InputRing::Record::Key : InputRing::Record::KeyText;
+        record.type = type;
+        record.key = qtkey;
+        record.modifiers = quint32(modifiers);
+        record.textLength = length;
+        memcpy(record.text, text.utf16() + offset, length * sizeof(char16_t));
+
+        if (!sendInput(record)) {
+            auto msg = FastPath::message<FastPath::KeyMessage>(last ? FastPath::KeyEvent : FastPath::KeyText,
+                                                               m_handle);
+            msg.type = type;
+            msg.key = qtkey;
+            msg.modifiers = quint32(modifiers);
+            msg.textLength = length;
+            memcpy(msg.text, text.utf16() + offset, length * sizeof(char16_t));
+            connection->send(msg);
+        }
+
+        offset += length;
+    } while (offset < text.size());
+}
+
+void Surface::sendBufferReleased(quint32 id)
+{
+    auto connection = this->connection();
+    if (!connection) {
+        emit bufferReleased(id);
+        return;
+    }
+
+    auto msg = FastPath::message<FastPath::BufferMessage>(FastPath::BufferReleased, m_handle);
+    msg.buffer = id;
+    connection->send(msg);
+}
+
+void Surface::sendFrameDone()
+{
+    auto connection = this->connection();
+    if (!connection) {
+        emit frameDone();
+        return;
+    }
+
+    connection->send(FastPath::message<FastPath::Message>(FastPath::FrameDone, m_handle));
+}
+
+void Surface::sendPresented(quint32 serial, qint64 timestamp, qint64 refreshInterval, bool onTime)
+{
+    auto connection = this->connection();
+    if (!connection) {
+        emit presented(serial, timestamp, refreshInterval, onTime);
+        return;
+    }
+
+    auto msg = FastPath::message<FastPath::PresentedMessage>(FastPath::Presented, m_handle);
+    msg.serial = serial;
+    msg.onTime = onTime;
+    msg.timestamp = timestamp;
+    msg.refreshInterval = refreshInterval;
+    connection->send(msg);
+}
+
 void Surface::destroy()
 {
     if (m_client)
@@ -192,36 +869,148 @@ void Surface::destroy()
 
 bool Surface::begin()
 {
+    touch();
     bool ok = m_window->begin();
     return ok;
 }
 
 void Surface::fillRect(QRect rect, QColor color)
 {
+    touch();
     m_window->fillRect(rect, color);
 }
 
 void Surface::drawText(QPoint pos, QString text, QColor color)
 {
+    touch();
     m_window->drawText(pos, text, color);
 }
 
 void Surface::end()
 {
+    touch();
     m_window->end();
 }
 
-QPair<QString, QSize> Surface::getShm()
+bool Surface::submit(QByteArray commands)
+{
+    touch();
+    return m_window->submit(commands);
+}
+
+bool Surface::setDisplayList(QByteArray commands)
+{
+    touch();
+    return m_window->setDisplayList(commands);
+}
+
+ShmBuffer Surface::getShm()
+{
+    touch();
+    const auto buffer = m_window->getShm();
+    return ShmBuffer(buffer.id, buffer.offset, buffer.size, buffer.bytesPerLine);
+}
+
+void Surface::releaseShm(quint32 id)
+{
+    touch();
+    m_window->releaseShm(id);
+}
+
+bool Surface::putImage(quint32 id, QRegion region)
+{
+    touch();
+    return m_window->putImage(id, region);
+}
+
+bool Surface::commit(quint32 id, QRegion region)
+{
+    touch();
+    return m_window->commit(id, region);
+}
+
+void Surface::setMotionHistory(bool enabled)
+{
+    touch();
+    m_window->setMotionHistory(enabled);
+}
+
+Screencast::Screencast(Capture *capture, Client *client, Protocol *parent)
+    : ScreencastSource(parent)
+    , m_capture(capture)
+    , m_client(client)
+    , m_handle(parent->m_screencasts.insert(this))
+{
+    connect(capture, &Capture::frameReady, this, &Screencast::frameReady);
+
+    if (client->shmPool->isValid())
+        capture->setShmPool(client->shmPool);
+
+    // 合成器在此时设置桌面的大小和格式，之后才能开放给客户端
+    emit parent->captureAdded(capture);
+
+    setObjectName(screencastName(m_handle));
+    parent->m_node.enableRemoting(this, objectName());
+}
+
+Screencast::~Screencast()
+{
+    destroy();
+}
+
+QSize Screencast::size() const
+{
+    return m_capture ? m_capture->size() : QSize();
+}
+
+int Screencast::format() const
+{
+    return m_capture ? m_capture->format() : QImage::Format_Invalid;
+}
+
+void Screencast::touch()
+{
+    if (m_client)
+        m_client->touch();
+}
+
+void Screencast::destroy()
+{
+    if (m_client)
+        m_client->destroyScreencast(this);
+    if (m_capture) {
+        m_capture->deleteLater();
+        m_capture = nullptr;
+    }
+}
+
+ShmBuffer Screencast::createBuffer()
+{
+    touch();
+    const auto buffer = m_capture->createBuffer();
+    return ShmBuffer(buffer.id, buffer.offset, buffer.size, buffer.bytesPerLine);
+}
+
+void Screencast::destroyBuffer(quint32 id)
+{
+    touch();
+    m_capture->destroyBuffer(id);
+}
+
+void Screencast::queueBuffer(quint32 id)
 {
-    return m_window->getShm();
+    touch();
+    m_capture->queueBuffer(id);
 }
 
-void Surface::releaseShm(QString key)
+void Screencast::start(int maxFps)
 {
-    m_window->releaseShm(key);
+    touch();
+    m_capture->start(maxFps);
 }
 
-bool Surface::putImage(QString key, QRegion region)
+void Screencast::stop()
 {
-    return m_window->putImage(key, region);
+    touch();
+    m_capture->stop();
 }
@@ -6,10 +6,27 @@
 #include <QObject>
 #include <QRemoteObjectRegistryHost>
 #include <QPointer>
+#include <QBasicTimer>
+#include <QElapsedTimer>
+
+#include <memory>
 
 #include "rep_kernel_source.h"
+#include "handletable.h"
+#include "inputring.h"
+
+QT_BEGIN_NAMESPACE
+class QSocketNotifier;
+QT_END_NAMESPACE
+
+namespace FastPath {
+struct Header;
+}
 
 class Window;
+class Capture;
+class ShmPool;
+class Connection;
 class Protocol;
 class Manager : public ManagerSource
 {
@@ -19,7 +36,7 @@ public:
 
     Protocol *parent();
 
-    QString createClient() override;
+    ClientInfo createClient() override;
     void destroyClient(const QString &id) override;
 };
 
@@ -39,7 +56,26 @@ public:
     bool visible() const override;
     void setVisible(bool visible) override;
 
+    quint32 handle() const override;
+
 private:
+    void touch();
+    Connection *connection() const;
+    // 客户端启用了共享内存输入队列时写入其中并返回 true
+    bool sendInput(const InputRing::Record &record);
+
+    // 客户端建立了 fastpath 连接时经由其发送，否则使用 QtRO 信号
+    void sendMouseEvent(QEvent::Type type, QPoint local, QPoint global,
+                        Qt::MouseButton button, Qt::MouseButtons buttons,
+                        Qt::KeyboardModifiers modifiers);
+    void sendWheelEvent(QPoint local, QPoint global, QPoint angleDelta,
+                        Qt::MouseButtons buttons, Qt::KeyboardModifiers modifiers);
+    void sendKeyEvent(QEvent::Type type, int qtkey, Qt::KeyboardModifiers modifiers,
+                      QString text);
+    void sendBufferReleased(quint32 id);
+    void sendFrameDone();
+    void sendPresented(quint32 serial, qint64 timestamp, qint64 refreshInterval, bool onTime);
+
     void destroy() override;
 
     // for render
@@ -47,14 +83,51 @@ private:
     void fillRect(QRect rect, QColor color) override;
     void drawText(QPoint pos, QString text, QColor color) override;
     void end() override;
+    bool submit(QByteArray commands) override;
+    bool setDisplayList(QByteArray commands) override;
 
     // for shm paint
-    QPair<QString, QSize> getShm() override;
-    void releaseShm(QString key) override;
-    bool putImage(QString key, QRegion region) override;
+    ShmBuffer getShm() override;
+    void releaseShm(quint32 id) override;
+    bool putImage(quint32 id, QRegion region) override;
+    bool commit(quint32 id, QRegion region) override;
+
+    // for input
+    void setMotionHistory(bool enabled) override;
 
     Window *m_window;
     QPointer<Client> m_client;
+    quint32 m_handle;
+};
+
+// 录屏，对应合成器一侧的 Capture
+class Screencast : public ScreencastSource
+{
+    friend class Protocol;
+    friend class Manager;
+    friend class Client;
+public:
+    explicit Screencast(Capture *capture, Client *client, Protocol *parent);
+    ~Screencast();
+
+    QSize size() const override;
+    int format() const override;
+
+private:
+    void touch();
+    void destroy() override;
+
+    // 缓冲区分配在客户端的共享内存池中，客户端提交后合成器才会写入
+    ShmBuffer createBuffer() override;
+    void destroyBuffer(quint32 id) override;
+    // 客户端读完并提交缓冲区后调用，合成器据此立即写入积压的变化
+    void queueBuffer(quint32 id) override;
+    void start(int maxFps) override;
+    void stop() override;
+
+    Capture *m_capture;
+    QPointer<Client> m_client;
+    quint32 m_handle;
 };
 
 class Client : public ClientSource
@@ -65,21 +138,48 @@ class Client : public ClientSource
     Q_OBJECT
 public:
     explicit Client(Protocol *parent);
+    ~Client();
 
     Protocol *parent();
     QString createSurface() override;
+    QString createScreencast() override;
 
 signals:
     void disconnected();
 
 private:
-    void doPing();
     void pong() override;
+    // 收到客户端的任何消息都视为其仍然存活
+    void touch();
     void destroySurface(Surface *surface);
-    void timerEvent(QTimerEvent *event);
-
-    int pingTimer = 0;
+    void destroyScreencast(Screencast *screencast);
+
+    void setConnection(Connection *connection);
+    void handleMessage(const FastPath::Header *message);
+    void handleCommit(const FastPath::Header *message);
+    void enableInputRing();
+    bool pushInput(const InputRing::Record &record);
+    bool writeInput(const InputRing::Record &record);
+    void flushInput();
+    void timerEvent(QTimerEvent *event) override;
+
+    // 存活检测的状态，单位为毫秒，由 Protocol 的时间轮统一处理
+    qint64 lastActivity = 0;
+    qint64 pingTime = -1;
+    int wheelSlot = -1;
     QList<Surface*> surfaces;
+    QList<Screencast*> screencasts;
+    std::shared_ptr<ShmPool> shmPool;
+    QPointer<Connection> connection;
+    // 建立 fastpath 连接的凭据，只通过 createClient 的返回值交给客户端
+    QByteArray fastPathToken;
+    quint32 handle = 0;
+    // 共享内存输入队列在内存池中的位置，及用于唤醒客户端的 eventfd
+    qint64 inputRingOffset = -1;
+    int inputRingFd = -1;
+    // 输入队列满时暂存的事件，客户端腾出空间后按顺序写入
+    QList<InputRing::Record> inputBacklog;
+    QBasicTimer inputTimer;
 };
 
 class Protocol : public QObject
@@ -87,6 +187,7 @@ class Protocol : public QObject
     friend class Manager;
     friend class Client;
     friend class Surface;
+    friend class Screencast;
     Q_OBJECT
 public:
     explicit Protocol(QObject *parent = nullptr);
@@ -98,8 +199,44 @@ public:
 signals:
     void windowAdded(Window *window);
     void windowRemoved(Window *window);
+    void captureAdded(Capture *capture);
+    void captureRemoved(Capture *capture);
 
 private:
+    qint64 now() const;
+    void scheduleLiveness(Client *client, qint64 deadline);
+    void unscheduleLiveness(Client *client);
+    void checkLiveness();
+    void timerEvent(QTimerEvent *event) override;
+
+    void onFastPathConnection();
+    void handleHello(Connection *connection, const FastPath::Header *message);
+    void checkHandshakes();
+
     QRemoteObjectHost m_node;
-    QList<Client*> m_clients;
+    Client *findClient(const QString &id) const;
+
+    // 客户端和 Surface 的 handle 在整个合成器内唯一，QtRO 的对象名也由其生成
+    HandleTable<Client*> m_clients;
+    HandleTable<Surface*> m_surfaces;
+    HandleTable<Screencast*> m_screencasts;
+
+    // 所有客户端共用的时间轮，每个槽对应 WheelTick 毫秒，只有空闲的客户端才会收到 ping
+    static constexpr int WheelSlots = 8;
+    static constexpr qint64 WheelTick = 1000;
+    QElapsedTimer m_clock;
+    QBasicTimer m_wheelTimer;
+    QList<Client*> m_wheel[WheelSlots];
+    int m_wheelSlot = 0;
+
+    // 监听 fastpath 连接
+    int m_fastPathSocket = -1;
+    QSocketNotifier *m_fastPathNotifier = nullptr;
+    // 还没有完成 Hello 握手的连接，超时后断开
+    struct Handshake {
+        QPointer<Connection> connection;
+        qint64 deadline;
+    };
+    QList<Handshake> m_handshakes;
+    QBasicTimer m_handshakeTimer;
 };
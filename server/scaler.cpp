@@ -0,0 +1,295 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#include "scaler.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static constexpr int WeightBits = 14;
+static constexpr int WeightOne = 1 << WeightBits;
+// 水平方向的中间结果保留 7 位小数，最大值 255 << 7 仍能放进 qint16
+static constexpr int IntermediateBits = 7;
+static constexpr int HorizontalShift = WeightBits - IntermediateBits;
+static constexpr int VerticalShift = WeightBits + IntermediateBits;
+
+void Scaler::Taps::init(int sourceSize, int targetSize)
+{
+    const double ratio = double(sourceSize) / targetSize;
+    stride = ratio <= 1 ? 2 : int(std::ceil(ratio)) + 1;
+    start.resize(targetSize);
+    count.resize(targetSize);
+    weights.fill(0, targetSize * stride);
+
+    QList<double> w(stride);
+    for (int i = 0; i < targetSize; ++i) {
+        int first, n;
+        w.fill(0);
+
+        if (ratio <= 1) {
+            // 放大：以像素中心对齐的双线性插值，边缘处只取最外侧的像素
+            const double center = (i + 0.5) * ratio - 0.5;
+            first = int(std::floor(center));
+            double f = center - first;
+            if (first < 0) {
+                first = 0;
+                f = 0;
+            } else if (first >= sourceSize - 1) {
+                first = sourceSize - 1;
+                f = 0;
+            }
+
+            n = f > 0 ? 2 : 1;
+            w[0] = 1 - f;
+            w[1] = f;
+        } else {
+            // 缩小：按覆盖面积对源像素取平均
+            const double a = i * ratio;
+            const double b = qMin((i + 1) * ratio, double(sourceSize));
+            first = int(std::floor(a));
+            n = qMin(int(std::ceil(b)), sourceSize) - first;
+            for (int k = 0; k < n; ++k)
+                w[k] = (qMin(b, first + k + 1.0) - qMax(a, double(first + k))) / (b - a);
+        }
+
+        // 量化后把误差补到最大的权重上，保证权重之和恰好为 1
+        qint16 *fixed = weights.data() + i * stride;
+        int sum = 0, largest = 0;
+        for (int k = 0; k < n; ++k) {
+            fixed[k] = qint16(qRound(w[k] * WeightOne));
+            sum += fixed[k];
+            if (fixed[k] > fixed[largest])
+                largest = k;
+        }
+        fixed[largest] += WeightOne - sum;
+
+        start[i] = first;
+        count[i] = n;
+    }
+}
+
+bool Scaler::Taps::map(int first, int last, int *targetFirst, int *targetLast) const
+{
+    // start 与 start + count 都随目标像素单调不减，二分查找即可
+    int lo = 0, hi = start.size();
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (start.at(mid) + count.at(mid) <= first)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *targetFirst = lo;
+
+    hi = start.size();
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (start.at(mid) <= last)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *targetLast = lo - 1;
+
+    return *targetFirst <= *targetLast;
+}
+
+Scaler::Scaler(const QSize &sourceSize, const QRect &targetRect)
+    : m_sourceSize(sourceSize)
+    , m_targetRect(targetRect)
+{
+    if (sourceSize.isEmpty() || targetRect.isEmpty())
+        return;
+
+    m_horizontal.init(sourceSize.width(), targetRect.width());
+    m_vertical.init(sourceSize.height(), targetRect.height());
+}
+
+QRect Scaler::mapRect(const QRect &sourceRect) const
+{
+    const QRect r = sourceRect & QRect(QPoint(0, 0), m_sourceSize);
+    if (r.isEmpty() || m_targetRect.isEmpty())
+        return QRect();
+
+    int left, right, top, bottom;
+    if (!m_horizontal.map(r.left(), r.right(), &left, &right)
+        || !m_vertical.map(r.top(), r.bottom(), &top, &bottom)) {
+        return QRect();
+    }
+
+    return QRect(QPoint(left, top), QPoint(right, bottom)).translated(m_targetRect.topLeft());
+}
+
+bool Scaler::isSupported(QImage::Format source, QImage::Format target)
+{
+    if (source != target)
+        return false;
+
+    switch (source) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+    case QImage::Format_RGB888:
+    case QImage::Format_BGR888:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool Scaler::scale(const QImage &source, QImage *target, const QRect &sourceRect) const
+{
+    if (!isSupported(source.format(), target->format()) || source.size() != m_sourceSize)
+        return false;
+
+    const QRect rect = mapRect(sourceRect) & target->rect();
+    if (rect.isEmpty())
+        return true;
+
+    if (source.depth() == 32)
+        scale<4>(source, target, rect);
+    else
+        scale<3>(source, target, rect);
+
+    return true;
+}
+
+// 水平方向缩放一行，结果为带 IntermediateBits 位小数的分量
+template<int Bpp>
+static void scaleRow(const uchar *src, qint16 *dst, const int *start, const int *count,
+                     const qint16 *weights, int stride, int width)
+{
+    for (int x = 0; x < width; ++x, weights += stride, dst += Bpp) {
+        const uchar *s = src + start[x] * Bpp;
+        const int n = count[x];
+
+#ifdef __SSE2__
+        if constexpr (Bpp == 4) {
+            // 两个像素的分量交错排列，_mm_madd_epi16 一次完成两个抽头的乘加
+            const __m128i zero = _mm_setzero_si128();
+            __m128i acc = zero;
+            int k = 0;
+            for (; k < n; k += 2) {
+                quint32 p0, p1 = 0;
+                memcpy(&p0, s + k * 4, 4);
+                if (k + 1 < n)
+                    memcpy(&p1, s + (k + 1) * 4, 4);
+                const quint32 w1 = k + 1 < n ? quint16(weights[k + 1]) : 0;
+
+                __m128i p = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p0), _mm_cvtsi32_si128(p1));
+                p = _mm_unpacklo_epi8(p, zero);
+                const __m128i w = _mm_set1_epi32(int((w1 << 16) | quint16(weights[k])));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(p, w));
+            }
+
+            acc = _mm_add_epi32(acc, _mm_set1_epi32(1 << (HorizontalShift - 1)));
+            acc = _mm_srai_epi32(acc, HorizontalShift);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packs_epi32(acc, acc));
+            continue;
+        }
+#endif
+
+        for (int c = 0; c < Bpp; ++c) {
+            int sum = 0;
+            for (int k = 0; k < n; ++k)
+                sum += s[k * Bpp + c] * weights[k];
+            dst[c] = qint16((sum + (1 << (HorizontalShift - 1))) >> HorizontalShift);
+        }
+    }
+}
+
+// 竖直方向合并若干行中间结果，写出 length 个 8 位分量
+static void scaleColumn(const qint16 *const *rows, const qint16 *weights, int n,
+                        uchar *dst, int length)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (VerticalShift - 1));
+    for (; i + 8 <= length; i += 8) {
+        __m128i low = zero, high = zero;
+        for (int k = 0; k < n; k += 2) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + i));
+            const __m128i b = k + 1 < n ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k + 1] + i))
+                                        : zero;
+            const quint32 w1 = k + 1 < n ? quint16(weights[k + 1]) : 0;
+            const __m128i w = _mm_set1_epi32(int((w1 << 16) | quint16(weights[k])));
+
+            low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+
+        low = _mm_srai_epi32(_mm_add_epi32(low, round), VerticalShift);
+        high = _mm_srai_epi32(_mm_add_epi32(high, round), VerticalShift);
+        const __m128i packed = _mm_packs_epi32(low, high);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(packed, packed));
+    }
+#endif
+
+    for (; i < length; ++i) {
+        int sum = 0;
+        for (int k = 0; k < n; ++k)
+            sum += rows[k][i] * weights[k];
+        dst[i] = uchar(qBound(0, (sum + (1 << (VerticalShift - 1))) >> VerticalShift, 255));
+    }
+}
+
+template<int Bpp>
+void Scaler::scale(const QImage &source, QImage *target, const QRect &targetRect) const
+{
+    const int x0 = targetRect.left() - m_targetRect.left();
+    const int y0 = targetRect.top() - m_targetRect.top();
+    const int width = targetRect.width();
+    const int height = targetRect.height();
+
+    // 比例为 1 时直接复制
+    if (m_targetRect.size() == m_sourceSize) {
+        for (int y = 0; y < height; ++y) {
+            memcpy(target->scanLine(targetRect.top() + y) + targetRect.left() * Bpp,
+                   source.constScanLine(y0 + y) + x0 * Bpp, width * Bpp);
+        }
+        return;
+    }
+
+    // 相邻的目标行共用源像素行，已经水平缩放过的行保存在环形缓冲区中。
+    // 目标行按顺序处理，一次最多需要 stride 行，不会互相覆盖
+    const int ringSize = m_vertical.stride;
+    const int length = width * Bpp;
+    std::vector<qint16> ring(ringSize * length);
+    std::vector<int> ringRows(ringSize, -1);
+    std::vector<const qint16*> rows(ringSize);
+
+    const int *start = m_horizontal.start.constData() + x0;
+    const int *count = m_horizontal.count.constData() + x0;
+    const qint16 *weights = m_horizontal.weightsAt(x0);
+
+    for (int y = 0; y < height; ++y) {
+        const int ty = y0 + y;
+        const int first = m_vertical.start.at(ty);
+        const int n = m_vertical.count.at(ty);
+
+        for (int k = 0; k < n; ++k) {
+            const int sy = first + k;
+            const int slot = sy % ringSize;
+            qint16 *row = ring.data() + slot * length;
+            if (ringRows[slot] != sy) {
+                scaleRow<Bpp>(source.constScanLine(sy), row, start, count, weights,
+                              m_horizontal.stride, width);
+                ringRows[slot] = sy;
+            }
+            rows[k] = row;
+        }
+
+        scaleColumn(rows.data(), m_vertical.weightsAt(ty), n,
+                    target->scanLine(targetRect.top() + y) + targetRect.left() * Bpp, length);
+    }
+}
@@ -0,0 +1,58 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QImage>
+#include <QList>
+
+// 把合成缓冲区缩放到输出屏幕。缩放比例固定，因此每个方向的滤波系数只在
+// 构造时计算一次：放大使用双线性插值，缩小使用盒式滤波。部分更新时按
+// 系数表找出受影响的全部目标像素并完整地重新计算，相邻的更新区域之间不会
+// 出现接缝
+class Scaler
+{
+public:
+    Scaler() = default;
+    Scaler(const QSize &sourceSize, const QRect &targetRect);
+
+    inline QSize sourceSize() const {
+        return m_sourceSize;
+    }
+    inline QRect targetRect() const {
+        return m_targetRect;
+    }
+
+    // 源图像中 sourceRect 内容变化后需要重新计算的目标区域
+    QRect mapRect(const QRect &sourceRect) const;
+    // 把 sourceRect 的变化更新到 target，像素格式不支持时返回 false
+    bool scale(const QImage &source, QImage *target, const QRect &sourceRect) const;
+
+    static bool isSupported(QImage::Format source, QImage::Format target);
+
+private:
+    // 一个方向上的系数表：目标像素 i 由源像素 [start[i], start[i] + count[i])
+    // 加权得到，权重为 14 位定点数且和为 1
+    struct Taps {
+        QList<int> start;
+        QList<int> count;
+        QList<qint16> weights;
+        int stride = 0;
+
+        void init(int sourceSize, int targetSize);
+        // 源区间 [first, last] 影响到的目标像素区间，没有时返回 false
+        bool map(int first, int last, int *targetFirst, int *targetLast) const;
+
+        inline const qint16 *weightsAt(int i) const {
+            return weights.constData() + i * stride;
+        }
+    };
+
+    template<int Bpp>
+    void scale(const QImage &source, QImage *target, const QRect &targetRect) const;
+
+    QSize m_sourceSize;
+    QRect m_targetRect;
+    Taps m_horizontal;
+    Taps m_vertical;
+};
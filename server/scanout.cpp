@@ -0,0 +1,245 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#include "scanout.h"
+#include "output.h"
+#include "scaler.h"
+
+#include <QPainter>
+#include <QSocketNotifier>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QTimerEvent>
+#include <QDeadlineTimer>
+#include <QDebug>
+
+#include <atomic>
+#include <utility>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+class ScanoutThread : public QThread
+{
+public:
+    ScanoutThread(Output *output, int doneFd);
+
+    void post(quint64 serial, const QImage &buffer, const QRegion &region);
+    void stop();
+
+    // 最近一次完成的送显
+    inline quint64 completed() const {
+        return m_completed.load(std::memory_order_acquire);
+    }
+
+private:
+    void run() override;
+    void scanout(const QImage &buffer, const QRegion &region);
+
+    Output *m_output;
+    int m_doneFd;
+    // 只在送显线程中使用
+    Scaler m_scaler;
+
+    // 主线程设置，送显线程取走
+    QMutex m_lock;
+    QWaitCondition m_condition;
+    bool m_stop = false;
+    bool m_pending = false;
+    quint64 m_serial = 0;
+    QImage m_buffer;
+    QRegion m_region;
+
+    std::atomic<quint64> m_completed { 0 };
+};
+
+ScanoutThread::ScanoutThread(Output *output, int doneFd)
+    : m_output(output)
+    , m_doneFd(doneFd)
+{
+    setObjectName(QStringLiteral("ScanoutThread"));
+}
+
+void ScanoutThread::post(quint64 serial, const QImage &buffer, const QRegion &region)
+{
+    QMutexLocker locker(&m_lock);
+
+    // 上一次送显还没开始，合并两次的区域，内容以最新的缓冲区为准
+    if (m_pending && !m_region.isEmpty() && !region.isEmpty())
+        m_region += region;
+    else
+        m_region = m_pending ? QRegion() : region;
+
+    m_serial = serial;
+    m_buffer = buffer;
+    m_pending = true;
+    m_condition.wakeOne();
+}
+
+void ScanoutThread::stop()
+{
+    QMutexLocker locker(&m_lock);
+    m_stop = true;
+    m_condition.wakeOne();
+}
+
+void ScanoutThread::run()
+{
+    QMutexLocker locker(&m_lock);
+
+    while (true) {
+        while (!m_stop && !m_pending)
+            m_condition.wait(&m_lock);
+        if (m_stop)
+            break;
+
+        const quint64 serial = m_serial;
+        QImage buffer = std::move(m_buffer);
+        const QRegion region = std::exchange(m_region, QRegion());
+        m_pending = false;
+        locker.unlock();
+
+        if (m_output->waitForVSync())
+            scanout(buffer, region);
+        // 通知主线程前释放浅拷贝，主线程再绘制时不必分离
+        buffer = QImage();
+
+        m_completed.store(serial, std::memory_order_release);
+        const quint64 value = 1;
+        if (write(m_doneFd, &value, sizeof(value)) != sizeof(value))
+            qWarning("Failed to notify the end of scanout");
+
+        locker.relock();
+    }
+}
+
+void ScanoutThread::scanout(const QImage &buffer, const QRegion &region)
+{
+    QRect targetRect = buffer.rect();
+    // 等比缩放到目标屏幕
+    targetRect.setSize(targetRect.size().scaled(m_output->size(), Qt::KeepAspectRatio));
+    //  居中显示
+    targetRect.moveCenter(m_output->rect().center());
+
+    // 缩放比例不变时复用之前计算的系数表，比例为 1 时直接复制
+    if (m_scaler.sourceSize() != buffer.size() || m_scaler.targetRect() != targetRect)
+        m_scaler = Scaler(buffer.size(), targetRect);
+
+    if (Scaler::isSupported(buffer.format(), m_output->format())) {
+        if (region.isEmpty()) {
+            m_scaler.scale(buffer, m_output, buffer.rect());
+        } else {
+            for (const QRect &r : region)
+                m_scaler.scale(buffer, m_output, r);
+        }
+        return;
+    }
+
+    // 像素格式不一致时交给 QPainter 转换
+    QPainter pa(m_output);
+    pa.setCompositionMode(QPainter::CompositionMode_Source);
+    pa.setRenderHint(QPainter::SmoothPixmapTransform);
+
+    if (region.isEmpty()) {
+        pa.drawImage(targetRect, buffer, buffer.rect());
+    } else {
+        QTransform mapToOutput;
+        mapToOutput.scale(qreal(targetRect.width()) / buffer.width(),
+                          qreal(targetRect.height()) / buffer.height());
+        mapToOutput.translate(targetRect.x(), targetRect.y());
+
+        for (const QRect &r : region) {
+            pa.drawImage(mapToOutput.mapRect(r), buffer, r);
+        }
+    }
+}
+
+Scanout::Scanout(Output *output, QObject *parent)
+    : QObject(parent)
+    , m_output(output)
+    , m_doneFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+    if (Q_UNLIKELY(m_doneFd < 0))
+        qFatal("Failed to create eventfd for the scanout thread");
+
+    m_notifier.reset(new QSocketNotifier(m_doneFd, QSocketNotifier::Read));
+    connect(m_notifier.data(), &QSocketNotifier::activated, this, &Scanout::onDone);
+
+    m_thread.reset(new ScanoutThread(output, m_doneFd));
+    m_thread->start(QThread::TimeCriticalPriority);
+}
+
+Scanout::~Scanout()
+{
+    stop();
+}
+
+bool Scanout::stop()
+{
+    if (!m_thread)
+        return true;
+
+    m_timeout.stop();
+    m_notifier.reset();
+    m_thread->stop();
+
+    // vblank 一直不来的屏幕上线程无法退出，不能因此卡住合成器的退出。线程和
+    // 它会写入的 eventfd 都留给进程结束时回收
+    if (!m_thread->wait(QDeadlineTimer(StopTimeout))) {
+        qWarning() << "Scanout thread for output" << m_output->size() << "did not stop, leaving it behind";
+        Q_UNUSED(m_thread.release());
+        return false;
+    }
+
+    m_thread.reset();
+    close(m_doneFd);
+    m_doneFd = -1;
+    return true;
+}
+
+bool Scanout::submit(const QImage &buffer, const QRegion &region)
+{
+    // 没有响应的屏幕仍然接收新的内容，恢复后显示最新的一帧
+    m_thread->post(++m_serial, buffer, region);
+    if (!m_responsive)
+        return false;
+
+    m_busy = true;
+    m_timeout.start(Timeout, this);
+    return true;
+}
+
+void Scanout::onDone()
+{
+    quint64 value;
+    while (read(m_doneFd, &value, sizeof(value)) > 0);
+
+    if (!m_responsive) {
+        m_responsive = true;
+        qInfo() << "Scanout recovered for output" << m_output->size();
+        return;
+    }
+
+    // 超时后才完成的旧送显不再通知
+    if (m_busy && m_thread->completed() == m_serial)
+        finish();
+}
+
+void Scanout::finish()
+{
+    m_busy = false;
+    m_timeout.stop();
+    emit finished();
+}
+
+void Scanout::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() != m_timeout.timerId())
+        return QObject::timerEvent(event);
+
+    // 只在第一次超时时警告，之后的帧不再等待这个屏幕
+    qWarning() << "Scanout timed out, vblank is not arriving for output" << m_output->size()
+               << ", stop waiting for it";
+    m_responsive = false;
+    finish();
+}
@@ -0,0 +1,74 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QObject>
+#include <QBasicTimer>
+#include <QImage>
+#include <QRegion>
+
+#include <memory>
+
+QT_BEGIN_NAMESPACE
+class QSocketNotifier;
+QT_END_NAMESPACE
+
+class Output;
+class ScanoutThread;
+// 每个屏幕一个送显线程，各自等待自己的 vblank 后把合成结果复制到 framebuffer，
+// 多个屏幕同时进行。完成后经由 eventfd 通知主线程
+class Scanout : public QObject
+{
+    Q_OBJECT
+public:
+    // 送显超过这个时间（毫秒）仍未完成时不再等待，避免一个屏幕卡住整个合成器
+    static constexpr int Timeout = 100;
+
+    // 退出时最多等待送显线程这么久（毫秒）
+    static constexpr int StopTimeout = 500;
+
+    explicit Scanout(Output *output, QObject *parent = nullptr);
+    ~Scanout();
+
+    // 停止送显线程。线程卡在 vblank 中超时未退出时不再等待，返回 false，此时
+    // 线程仍在使用 output，调用者不能释放它
+    bool stop();
+
+    inline Output *output() const {
+        return m_output;
+    }
+
+    // 送显 buffer 中 region 的部分，region 为空时送显整个缓冲区。上一次送显还
+    // 未开始时与其合并。送显线程持有 buffer 的浅拷贝，在此期间修改 buffer 会使
+    // 其分离，而不会影响正在送显的内容。返回 false 表示该屏幕没有响应，本次
+    // 送显不会发出 finished，合成器也不必等待
+    bool submit(const QImage &buffer, const QRegion &region);
+    // 最近一次 submit 是否还在等待完成
+    inline bool isBusy() const {
+        return m_busy;
+    }
+    // 超时后视为没有响应，直到送显线程再次完成一次送显
+    inline bool isResponsive() const {
+        return m_responsive;
+    }
+
+signals:
+    // 每次返回 true 的 submit 之后发出一次，超时也视为完成
+    void finished();
+
+private:
+    void onDone();
+    void finish();
+    void timerEvent(QTimerEvent *event) override;
+
+    Output *m_output;
+    std::unique_ptr<ScanoutThread> m_thread;
+    int m_doneFd = -1;
+    QScopedPointer<QSocketNotifier> m_notifier;
+
+    quint64 m_serial = 0;
+    bool m_busy = false;
+    bool m_responsive = true;
+    QBasicTimer m_timeout;
+};
@@ -6,20 +6,43 @@ CONFIG += link_pkgconfig
 PKGCONFIG += libinput libudev
 
 REPC_SOURCE = ../protocols/kernel.rep
+INCLUDEPATH += ../protocols
 
 HEADERS += \
+    ../protocols/drawcommands.h \
+    ../protocols/fastpath.h \
+    ../protocols/inputring.h \
+    ../protocols/shm.h \
+    capture.h \
     compositor.h \
+    connection.h \
+    handletable.h \
     input.h \
     output.h \
     protocol.h \
+    scaler.h \
+    scanout.h \
+    shmpool.h \
+    solidfill.h \
+    spscqueue.h \
+    textcache.h \
+    tiledamage.h \
     virtualoutput.h
 
 SOURCES += \
+    capture.cpp \
     compositor.cpp \
+    connection.cpp \
     input.cpp \
     main.cpp \
     output.cpp \
     protocol.cpp \
+    scaler.cpp \
+    scanout.cpp \
+    shmpool.cpp \
+    solidfill.cpp \
+    textcache.cpp \
+    tiledamage.cpp \
     virtualoutput.cpp
 
 RESOURCES += \
@@ -0,0 +1,128 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#include "shmpool.h"
+
+#include <QDebug>
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static constexpr qint64 PageSize = 4096;
+
+ShmPool::ShmPool(qint64 capacity)
+{
+    m_fd = memfd_create("X.STONE-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (m_fd < 0) {
+        qWarning() << "Can't create memfd:" << strerror(errno);
+        return;
+    }
+
+    if (ftruncate(m_fd, capacity) < 0) {
+        qWarning() << "Can't resize memfd:" << strerror(errno);
+        return;
+    }
+
+    // 禁止客户端改变大小，避免合成器访问时因文件被截断而收到 SIGBUS
+    if (fcntl(m_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        qWarning() << "Can't seal memfd:" << strerror(errno);
+        return;
+    }
+
+    void *ptr = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (ptr == MAP_FAILED) {
+        qWarning() << "Can't map memfd:" << strerror(errno);
+        return;
+    }
+
+    m_data = static_cast<uchar*>(ptr);
+    m_capacity = capacity;
+    m_freeBlocks.insert(0, capacity);
+}
+
+ShmPool::~ShmPool()
+{
+    if (m_data)
+        munmap(m_data, m_capacity);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool ShmPool::isValid() const
+{
+    return m_data;
+}
+
+int ShmPool::fd() const
+{
+    return m_fd;
+}
+
+qint64 ShmPool::capacity() const
+{
+    return m_capacity;
+}
+
+uchar *ShmPool::data() const
+{
+    return m_data;
+}
+
+qint64 ShmPool::allocate(qint64 size)
+{
+    if (size <= 0)
+        return -1;
+
+    // 按页对齐，释放时才能把整页归还给内核
+    size = (size + PageSize - 1) & ~(PageSize - 1);
+
+    for (auto i = m_freeBlocks.begin(); i != m_freeBlocks.end(); ++i) {
+        if (i.value() < size)
+            continue;
+
+        const qint64 offset = i.key();
+        const qint64 remaining = i.value() - size;
+        m_freeBlocks.erase(i);
+
+        if (remaining > 0)
+            m_freeBlocks.insert(offset + size, remaining);
+        m_usedBlocks.insert(offset, size);
+
+        return offset;
+    }
+
+    qWarning() << "Shared memory pool is full, request size:" << size;
+    return -1;
+}
+
+void ShmPool::free(qint64 offset)
+{
+    auto used = m_usedBlocks.find(offset);
+    if (used == m_usedBlocks.end())
+        return;
+
+    qint64 size = used.value();
+    m_usedBlocks.erase(used);
+
+    // 释放物理内存，虚拟地址仍然保留在池中
+    fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+
+    // 与相邻的空闲块合并
+    auto next = m_freeBlocks.lowerBound(offset);
+    if (next != m_freeBlocks.end() && next.key() == offset + size) {
+        size += next.value();
+        next = m_freeBlocks.erase(next);
+    }
+
+    if (next != m_freeBlocks.begin()) {
+        auto prev = std::prev(next);
+        if (prev.key() + prev.value() == offset) {
+            prev.value() += size;
+            return;
+        }
+    }
+
+    m_freeBlocks.insert(offset, size);
+}
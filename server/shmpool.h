@@ -0,0 +1,35 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QMap>
+#include <QHash>
+
+// 每个客户端一个的共享内存池，基于 sealed memfd 实现
+class ShmPool
+{
+public:
+    // 只占用虚拟地址空间，物理内存在实际写入时才分配
+    static constexpr qint64 DefaultCapacity = qint64(256) << 20;
+
+    explicit ShmPool(qint64 capacity = DefaultCapacity);
+    ~ShmPool();
+
+    bool isValid() const;
+    int fd() const;
+    qint64 capacity() const;
+    uchar *data() const;
+
+    qint64 allocate(qint64 size);
+    void free(qint64 offset);
+
+private:
+    int m_fd = -1;
+    uchar *m_data = nullptr;
+    qint64 m_capacity = 0;
+
+    // offset -> size
+    QMap<qint64, qint64> m_freeBlocks;
+    QHash<qint64, qint64> m_usedBlocks;
+};
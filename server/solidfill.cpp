@@ -0,0 +1,149 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#include "solidfill.h"
+
+#include <QPainter>
+
+#include <cstring>
+#include <type_traits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace SolidFill {
+
+// 把 color 转换为 format 下一个像素的字节，返回每像素字节数，不支持时返回 0
+static int pixelBytes(QImage::Format format, QRgb color, uchar *bytes)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied: {
+        const quint32 pixel = 0xff000000 | color;
+        memcpy(bytes, &pixel, 4);
+        return 4;
+    }
+    case QImage::Format_RGB888:
+        bytes[0] = qRed(color);
+        bytes[1] = qGreen(color);
+        bytes[2] = qBlue(color);
+        return 3;
+    case QImage::Format_RGB16: {
+        const quint16 pixel = ((qRed(color) >> 3) << 11) | ((qGreen(color) >> 2) << 5) | (qBlue(color) >> 3);
+        memcpy(bytes, &pixel, 2);
+        return 2;
+    }
+    default:
+        break;
+    }
+
+    // 其它 16/24/32 位格式借助 QImage 转换一次
+    QImage pixel(1, 1, format);
+    const int bpp = pixel.depth() / 8;
+    if (pixel.depth() % 8 || bpp < 2 || bpp > 4)
+        return 0;
+
+    pixel.fill(QColor::fromRgb(color));
+    memcpy(bytes, pixel.constBits(), bpp);
+    return bpp;
+}
+
+template<int Bpp>
+static void fillRow(uchar *dst, int count, const uchar *pixel)
+{
+    if constexpr (Bpp == 3) {
+        // 48 字节恰好是 16 个像素，用三个 16 字节的寄存器循环写入
+        alignas(16) uchar pattern[48];
+        for (int i = 0; i < 16; ++i)
+            memcpy(pattern + i * 3, pixel, 3);
+
+        int x = 0;
+#ifdef __SSE2__
+        const __m128i p0 = _mm_load_si128(reinterpret_cast<const __m128i*>(pattern));
+        const __m128i p1 = _mm_load_si128(reinterpret_cast<const __m128i*>(pattern + 16));
+        const __m128i p2 = _mm_load_si128(reinterpret_cast<const __m128i*>(pattern + 32));
+        for (; x + 16 <= count; x += 16, dst += 48) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), p0);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16), p1);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 32), p2);
+        }
+#else
+        for (; x + 16 <= count; x += 16, dst += 48)
+            memcpy(dst, pattern, 48);
+#endif
+        memcpy(dst, pattern, (count - x) * 3);
+    } else {
+        using Pixel = std::conditional_t<Bpp == 4, quint32, quint16>;
+        Pixel value;
+        memcpy(&value, pixel, Bpp);
+
+        int x = 0;
+#ifdef __SSE2__
+        const __m128i v = Bpp == 4 ? _mm_set1_epi32(int(value)) : _mm_set1_epi16(short(value));
+        constexpr int PerStore = 16 / Bpp;
+        for (; x + PerStore * 2 <= count; x += PerStore * 2, dst += 32) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), v);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16), v);
+        }
+#endif
+        Pixel *p = reinterpret_cast<Pixel*>(dst);
+        for (; x < count; ++x)
+            *p++ = value;
+    }
+}
+
+template<int Bpp>
+static void fillRect(QImage *image, const QRect &rect, const uchar *pixel)
+{
+    const qsizetype bpl = image->bytesPerLine();
+    uchar *line = image->bits() + rect.y() * bpl + rect.x() * Bpp;
+
+    for (int y = 0; y < rect.height(); ++y, line += bpl)
+        fillRow<Bpp>(line, rect.width(), pixel);
+}
+
+bool fill(QImage *image, const QRect &rect, QRgb color, const QRegion &clip)
+{
+    uchar pixel[4];
+    const int bpp = pixelBytes(image->format(), color, pixel);
+    if (!bpp)
+        return false;
+
+    const QRegion region = clip & (rect & image->rect());
+    for (const QRect &r : region) {
+        switch (bpp) {
+        case 2: fillRect<2>(image, r, pixel); break;
+        case 3: fillRect<3>(image, r, pixel); break;
+        case 4: fillRect<4>(image, r, pixel); break;
+        }
+    }
+
+    return true;
+}
+
+void fillRect(QPainter *painter, const QRect &rect, const QColor &color)
+{
+    QPaintDevice *device = painter->device();
+    const QTransform &transform = painter->deviceTransform();
+    const auto mode = painter->compositionMode();
+
+    if (color.alpha() == 255 && painter->opacity() == 1.0
+        && (mode == QPainter::CompositionMode_SourceOver || mode == QPainter::CompositionMode_Source)
+        && device && device->devType() == QInternal::Image
+        && transform.type() <= QTransform::TxTranslate) {
+        auto image = static_cast<QImage*>(device);
+        const QPoint offset(qRound(transform.dx()), qRound(transform.dy()));
+        // 转换到设备坐标后再与 painter 的裁剪区域求交
+        const QRegion clip = painter->hasClipping() ? painter->clipRegion().translated(offset)
+                                                    : QRegion(image->rect());
+
+        if (fill(image, rect.translated(offset), color.rgb(), clip))
+            return;
+    }
+
+    painter->fillRect(rect, color);
+}
+
+} // namespace SolidFill
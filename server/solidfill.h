@@ -0,0 +1,23 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QImage>
+#include <QRegion>
+
+QT_BEGIN_NAMESPACE
+class QPainter;
+QT_END_NAMESPACE
+
+// 不透明纯色填充的快速路径，绕过 QPainter 直接写入目标图像
+namespace SolidFill {
+
+// 用不透明的 color 填充 image 中 rect 与 clip 的交集，不支持的像素格式返回 false
+bool fill(QImage *image, const QRect &rect, QRgb color, const QRegion &clip);
+
+// painter 的目标是图像、变换只有平移且颜色不透明时直接填充（遵循 painter 的
+// 裁剪区域），否则回退到 QPainter::fillRect
+void fillRect(QPainter *painter, const QRect &rect, const QColor &color);
+
+} // namespace SolidFill
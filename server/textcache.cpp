@@ -0,0 +1,236 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#include "textcache.h"
+
+#include <QPainter>
+#include <QPainterPath>
+#include <QTextLayout>
+#include <QGlyphRun>
+#include <QtMath>
+#include <QDebug>
+
+static constexpr int MaxLayoutCount = 1024;
+static constexpr int AtlasSize = 1024;
+// 字形之间留出的空隙，避免相邻字形的抗锯齿边缘互相干扰
+static constexpr int GlyphPadding = 1;
+
+TextCache *TextCache::instance()
+{
+    static TextCache cache;
+    return &cache;
+}
+
+TextCache::TextCache()
+    : m_layouts(MaxLayoutCount)
+{
+    resetAtlas();
+}
+
+bool TextCache::isSingleLine(const QString &text)
+{
+    // 与 QPainter::drawText 换行的字符一致
+    for (QChar c : text) {
+        if (c == QLatin1Char('\n') || c == QChar::LineSeparator)
+            return false;
+    }
+    return true;
+}
+
+QRect TextCache::boundingRect(const QFont &font, const QPoint &pos, const QString &text)
+{
+    const Layout *l = layout(font, text);
+    return QRect(pos, l->size);
+}
+
+const TextCache::Layout *TextCache::layout(const QFont &font, const QString &text)
+{
+    const QString key = font.key() + QChar(QChar::Null) + text;
+    if (auto l = m_layouts.object(key))
+        return l;
+
+    auto l = new Layout;
+
+    QTextLayout textLayout(text, font);
+    textLayout.setCacheEnabled(true);
+    textLayout.beginLayout();
+    QTextLine line = textLayout.createLine();
+    if (line.isValid())
+        line.setNumColumns(text.size());
+    textLayout.endLayout();
+
+    if (line.isValid()) {
+        l->size = QSize(qCeil(line.naturalTextWidth()), qCeil(line.height()));
+
+        const auto runs = textLayout.glyphRuns();
+        for (const QGlyphRun &run : runs) {
+            const int font = fontId(run.rawFont());
+            const auto indexes = run.glyphIndexes();
+            const auto positions = run.positions();
+
+            for (int i = 0; i < indexes.size(); ++i)
+                l->glyphs.append({ font, indexes.at(i), positions.at(i).toPoint() });
+        }
+    }
+
+    m_layouts.insert(key, l);
+    return l;
+}
+
+int TextCache::fontId(const QRawFont &font)
+{
+    const QString key = QStringLiteral("%1|%2|%3|%4").arg(font.familyName(), font.styleName())
+                                                      .arg(font.pixelSize()).arg(font.weight());
+    auto it = m_fontIds.constFind(key);
+    if (it != m_fontIds.constEnd())
+        return it.value();
+
+    m_fonts.append(font);
+    m_fontIds.insert(key, m_fonts.size() - 1);
+    return m_fonts.size() - 1;
+}
+
+const TextCache::CachedGlyph *TextCache::glyph(int font, quint32 index)
+{
+    const GlyphKey key { font, index };
+    auto it = m_glyphs.constFind(key);
+    if (it != m_glyphs.constEnd())
+        return &it.value();
+
+    // 用字形的轮廓光栅化，位置完全由路径的包围盒决定
+    const QPainterPath path = m_fonts.at(font).pathForGlyph(index);
+    const QRect bounds = path.boundingRect().toAlignedRect();
+
+    CachedGlyph glyph;
+    glyph.offset = bounds.topLeft();
+
+    if (!bounds.isEmpty()) {
+        if (bounds.width() + GlyphPadding > AtlasSize || bounds.height() + GlyphPadding > AtlasSize)
+            return nullptr;
+
+        if (m_shelfX + bounds.width() + GlyphPadding > AtlasSize) {
+            m_shelfX = 0;
+            m_shelfY += m_shelfHeight;
+            m_shelfHeight = 0;
+        }
+
+        // 图集已满，丢弃所有字形重新开始，排版结果不受影响
+        if (m_shelfY + bounds.height() + GlyphPadding > AtlasSize) {
+            resetAtlas();
+            return this->glyph(font, index);
+        }
+
+        glyph.rect = QRect(QPoint(m_shelfX, m_shelfY), bounds.size());
+        m_shelfX += bounds.width() + GlyphPadding;
+        m_shelfHeight = qMax(m_shelfHeight, bounds.height() + GlyphPadding);
+
+        QPainter pa(&m_atlas);
+        pa.setRenderHint(QPainter::Antialiasing);
+        pa.setClipRect(glyph.rect);
+        pa.translate(glyph.rect.topLeft() - bounds.topLeft());
+        pa.fillPath(path, Qt::black);
+    }
+
+    return &m_glyphs.insert(key, glyph).value();
+}
+
+void TextCache::resetAtlas()
+{
+    if (m_atlas.isNull())
+        m_atlas = QImage(AtlasSize, AtlasSize, QImage::Format_Alpha8);
+    m_atlas.fill(0);
+    m_glyphs.clear();
+    m_shelfX = 0;
+    m_shelfY = 0;
+    m_shelfHeight = 0;
+}
+
+template<int Bpp>
+static void blendGlyph(QImage *target, const QPoint &pos, const QImage &atlas,
+                       const QRect &source, const QRect &clip, QRgb color)
+{
+    const QRect dest = QRect(pos, source.size()) & clip;
+    if (dest.isEmpty())
+        return;
+
+    const int alpha = qAlpha(color);
+    const int red = qRed(color);
+    const int green = qGreen(color);
+    const int blue = qBlue(color);
+    const QPoint src = source.topLeft() + (dest.topLeft() - pos);
+
+    for (int y = 0; y < dest.height(); ++y) {
+        const uchar *coverage = atlas.constScanLine(src.y() + y) + src.x();
+        uchar *d = target->scanLine(dest.y() + y) + dest.x() * Bpp;
+
+        for (int x = 0; x < dest.width(); ++x, d += Bpp) {
+            const int a = coverage[x] * alpha / 255;
+            if (!a)
+                continue;
+
+            if constexpr (Bpp == 3) {
+                // Format_RGB888 按 R, G, B 的字节顺序存放
+                d[0] += (red - d[0]) * a / 255;
+                d[1] += (green - d[1]) * a / 255;
+                d[2] += (blue - d[2]) * a / 255;
+            } else {
+                // 32 位格式按 QRgb 存放
+                QRgb *p = reinterpret_cast<QRgb*>(d);
+                const int dr = qRed(*p), dg = qGreen(*p), db = qBlue(*p), da = qAlpha(*p);
+                *p = qRgba(dr + (red - dr) * a / 255,
+                           dg + (green - dg) * a / 255,
+                           db + (blue - db) * a / 255,
+                           da + (255 - da) * a / 255);
+            }
+        }
+    }
+}
+
+bool TextCache::drawText(QPainter *painter, const QPoint &pos, const QString &text,
+                         const QColor &color, const QRegion &clip)
+{
+    if (!isSingleLine(text))
+        return false;
+
+    QPaintDevice *device = painter->device();
+    if (!device || device->devType() != QInternal::Image)
+        return false;
+
+    const QTransform &transform = painter->deviceTransform();
+    if (transform.type() > QTransform::TxTranslate)
+        return false;
+
+    auto target = static_cast<QImage*>(device);
+    const QImage::Format format = target->format();
+    if (format != QImage::Format_RGB888 && format != QImage::Format_RGB32
+        && format != QImage::Format_ARGB32_Premultiplied) {
+        return false;
+    }
+
+    const QPoint offset(qRound(transform.dx()), qRound(transform.dy()));
+    const QRegion deviceClip = clip.translated(offset) & target->rect();
+    const QPoint origin = pos + offset;
+    const QRgb rgb = color.rgba();
+
+    const Layout *l = layout(painter->font(), text);
+    // glyph() 可能重置图集，所以每个字形取得后立即绘制
+    for (const auto &g : l->glyphs) {
+        const CachedGlyph *cached = glyph(g.font, g.index);
+        if (!cached || cached->rect.isEmpty())
+            continue;
+
+        const QPoint glyphPos = origin + g.pos + cached->offset;
+        const QRect glyphRect(glyphPos, cached->rect.size());
+        for (const QRect &r : deviceClip) {
+            if (!r.intersects(glyphRect))
+                continue;
+
+            if (format == QImage::Format_RGB888)
+                blendGlyph<3>(target, glyphPos, m_atlas, cached->rect, r, rgb);
+            else
+                blendGlyph<4>(target, glyphPos, m_atlas, cached->rect, r, rgb);
+        }
+    }
+
+    return true;
+}
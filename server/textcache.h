@@ -0,0 +1,82 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QCache>
+#include <QHash>
+#include <QImage>
+#include <QRawFont>
+#include <QRegion>
+
+QT_BEGIN_NAMESPACE
+class QPainter;
+QT_END_NAMESPACE
+
+// Window::drawText 的缓存：按 (字体, 文本) 缓存排版结果，字形光栅化后放在
+// 一张 Alpha8 的图集中，重复绘制同样的文本时只需把字形混合到目标图像上
+class TextCache
+{
+public:
+    static TextCache *instance();
+
+    // 缓存只处理单行文本，多行文本需要使用 QPainter 测量和绘制
+    static bool isSingleLine(const QString &text);
+
+    // 与 QPainter::boundingRect 对单行文本的结果一致
+    QRect boundingRect(const QFont &font, const QPoint &pos, const QString &text);
+    // 直接写入 painter 的目标图像，只绘制 clip 以内的部分。无法处理时（多行文本、
+    // 不支持的像素格式或变换）返回 false，调用者应回退到 QPainter::drawText
+    bool drawText(QPainter *painter, const QPoint &pos, const QString &text,
+                  const QColor &color, const QRegion &clip);
+
+private:
+    TextCache();
+
+    struct Layout {
+        struct Glyph {
+            int font;
+            quint32 index;
+            // 相对于文本左上角的基线位置，已对齐到像素
+            QPoint pos;
+        };
+
+        QList<Glyph> glyphs;
+        QSize size;
+    };
+
+    struct GlyphKey {
+        int font;
+        quint32 index;
+
+        bool operator==(const GlyphKey &other) const {
+            return font == other.font && index == other.index;
+        }
+    };
+    friend size_t qHash(const GlyphKey &key, size_t seed) {
+        return qHashMulti(seed, key.font, key.index);
+    }
+
+    struct CachedGlyph {
+        // 在图集中的位置，空字形（如空格）为空矩形
+        QRect rect;
+        // 左上角相对于基线位置的偏移
+        QPoint offset;
+    };
+
+    const Layout *layout(const QFont &font, const QString &text);
+    int fontId(const QRawFont &font);
+    const CachedGlyph *glyph(int font, quint32 index);
+    void resetAtlas();
+
+    QCache<QString, Layout> m_layouts;
+    QList<QRawFont> m_fonts;
+    QHash<QString, int> m_fontIds;
+
+    QImage m_atlas;
+    QHash<GlyphKey, CachedGlyph> m_glyphs;
+    // 按行（shelf）从左到右放置字形
+    int m_shelfX = 0;
+    int m_shelfY = 0;
+    int m_shelfHeight = 0;
+};
@@ -0,0 +1,133 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#include "tiledamage.h"
+
+TileDamage::TileDamage(const QRect &bounds)
+{
+    setBounds(bounds);
+}
+
+void TileDamage::setBounds(const QRect &bounds)
+{
+    m_bounds = bounds.isEmpty() ? QRect() : bounds;
+    m_rows = (m_bounds.height() + TileSize - 1) / TileSize;
+    m_columns = (m_bounds.width() + TileSize - 1) / TileSize;
+    m_wordsPerRow = (m_columns + 63) / 64;
+    m_bits.fill(0, m_rows * m_wordsPerRow);
+    m_empty = true;
+}
+
+void TileDamage::clear()
+{
+    if (m_empty)
+        return;
+
+    m_bits.fill(0);
+    m_empty = true;
+}
+
+void TileDamage::add(const QRect &rect)
+{
+    const QRect r = rect & m_bounds;
+    if (r.isEmpty())
+        return;
+
+    const int firstRow = (r.top() - m_bounds.top()) / TileSize;
+    const int lastRow = (r.bottom() - m_bounds.top()) / TileSize;
+    const int firstColumn = (r.left() - m_bounds.left()) / TileSize;
+    const int lastColumn = (r.right() - m_bounds.left()) / TileSize;
+
+    for (int row = firstRow; row <= lastRow; ++row) {
+        quint64 *words = m_bits.data() + row * m_wordsPerRow;
+        for (int word = firstColumn / 64; word <= lastColumn / 64; ++word) {
+            const int first = qMax(firstColumn - word * 64, 0);
+            const int last = qMin(lastColumn - word * 64, 63);
+            const quint64 high = last == 63 ? ~quint64(0) : (quint64(1) << (last + 1)) - 1;
+            words[word] |= high & ~((quint64(1) << first) - 1);
+        }
+    }
+
+    m_empty = false;
+}
+
+void TileDamage::add(const QRegion &region)
+{
+    for (const QRect &r : region)
+        add(r);
+}
+
+QList<QRect> TileDamage::rects() const
+{
+    QList<QRect> rects;
+    if (m_empty)
+        return rects;
+
+    // 逐行找出连续的 tile，与上一行起止相同的段向下延伸为同一个矩形
+    struct Span {
+        int first;
+        int last;
+        int index;
+    };
+    QList<Span> previous, current;
+
+    for (int row = 0; row < m_rows; ++row) {
+        current.clear();
+
+        for (int column = 0; column < m_columns; ++column) {
+            if (!testTile(row, column))
+                continue;
+
+            const int first = column;
+            while (column + 1 < m_columns && testTile(row, column + 1))
+                ++column;
+
+            int index = -1;
+            for (const Span &span : std::as_const(previous)) {
+                if (span.first == first && span.last == column) {
+                    index = span.index;
+                    break;
+                }
+            }
+
+            if (index < 0) {
+                index = rects.size();
+                rects.append(QRect(first * TileSize, row * TileSize,
+                                   (column - first + 1) * TileSize, TileSize));
+            } else {
+                rects[index].setBottom(row * TileSize + TileSize - 1);
+            }
+
+            current.append({ first, column, index });
+        }
+
+        previous.swap(current);
+    }
+
+    if (rects.size() > MaxRects) {
+        QRect bounding;
+        for (const QRect &r : std::as_const(rects))
+            bounding |= r;
+        rects = { bounding };
+    }
+
+    for (QRect &r : rects)
+        r = r.translated(m_bounds.topLeft()) & m_bounds;
+
+    return rects;
+}
+
+QRegion TileDamage::region() const
+{
+    QRegion region;
+    for (const QRect &r : rects())
+        region += r;
+    return region;
+}
+
+QRegion TileDamage::simplified(const QRegion &region, const QRect &bounds)
+{
+    TileDamage damage(bounds);
+    damage.add(region);
+    return damage.region();
+}
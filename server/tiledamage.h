@@ -0,0 +1,65 @@
+// Copyright (C) 2024 JiDe Zhang <zhangjide@deepin.org>.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <QList>
+#include <QRect>
+#include <QRegion>
+
+// 以固定大小的 tile 记录损坏区域，每个 tile 一个比特。添加区域的开销只与
+// 覆盖的 tile 数有关，不会随着更新的碎片化而增长；取出时相邻的 tile 合并为
+// 矩形，数量有上限
+class TileDamage
+{
+public:
+    static constexpr int TileSize = 64;
+    // rects() 返回的矩形超过这个数量时以包围盒代替
+    static constexpr int MaxRects = 32;
+
+    TileDamage() = default;
+    explicit TileDamage(const QRect &bounds);
+
+    inline QRect bounds() const {
+        return m_bounds;
+    }
+    // 同时清空已记录的区域
+    void setBounds(const QRect &bounds);
+
+    inline bool isEmpty() const {
+        return m_empty;
+    }
+    void clear();
+
+    // 超出 bounds 的部分被忽略
+    void add(const QRect &rect);
+    void add(const QRegion &region);
+
+    inline TileDamage &operator+=(const QRect &rect) {
+        add(rect);
+        return *this;
+    }
+    inline TileDamage &operator+=(const QRegion &region) {
+        add(region);
+        return *this;
+    }
+
+    // 对齐到 tile 并限制在 bounds 内的矩形，互不重叠
+    QList<QRect> rects() const;
+    QRegion region() const;
+
+    // 把 region 在 bounds 内按 tile 对齐并合并，用于来自客户端的任意区域
+    static QRegion simplified(const QRegion &region, const QRect &bounds);
+
+private:
+    inline bool testTile(int row, int column) const {
+        return m_bits.at(row * m_wordsPerRow + column / 64) & (quint64(1) << (column % 64));
+    }
+
+    QRect m_bounds;
+    int m_rows = 0;
+    int m_columns = 0;
+    int m_wordsPerRow = 0;
+    QList<quint64> m_bits;
+    bool m_empty = true;
+};